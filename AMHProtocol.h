@@ -0,0 +1,149 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AMHProtocol.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Command set of the Andor AMH200: command formats, encoding
+//                tables and reply parsers
+// COPYRIGHT:     University of California, San Francisco, 2006
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _AMHPROTOCOL_H_
+#define _AMHPROTOCOL_H_
+
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * A command is a traits struct: its name, the range of its one integer
+ * argument, its terminator and the form of its reply.  Table<Command>
+ * sizes its buffers from these at compile time and encodes every
+ * argument once, so sending any command is a table lookup; the reply
+ * form parses in place.  Nothing here allocates.
+ *
+ * Adding a command is a new traits struct, and a new reply form if the
+ * answer is not R/E,nn.
+ */
+namespace AMHProtocol
+{
+   constexpr unsigned StrLength(const char* s) { return *s == 0 ? 0 : 1 + StrLength(s + 1); }
+   constexpr unsigned Digits(long n) { return n < 10 ? 1 : 1 + Digits(n / 10); }
+
+   /**
+    * The answer to a setting command: R when accepted, E,nn with the
+    * firmware's error number otherwise.
+    */
+   struct AckReply
+   {
+      enum Kind { Ack, Error, Unrecognised };
+
+      Kind kind;
+      int code;                     // nn of E,nn
+
+      static AckReply Parse(const char* answer)
+      {
+         AckReply reply;
+         reply.code = 0;
+         if (answer[0] == 'R')
+            reply.kind = Ack;
+         else if (answer[0] == 'E' && answer[1] != 0 && answer[2] != 0)
+         {
+            reply.kind = Error;
+            reply.code = atoi(answer + 2);
+         }
+         else
+            reply.kind = Unrecognised;
+         return reply;
+      }
+
+      // DEVICE_OK for R, errorOffset + nn for E,nn; Unrecognised needs
+      // its own handling
+      int ToDeviceError(int errorOffset) const { return kind == Ack ? 0 : errorOffset + code; }
+   };
+
+   /**
+    * LIGHT,n: light output n percent, 0 for off.
+    */
+   struct Light
+   {
+      static constexpr const char* Name() { return "LIGHT"; }
+      static const long MinArg = 0;
+      static const long MaxArg = 100;
+      static const char Terminator = '\r';
+      typedef AckReply Reply;
+   };
+
+   /**
+    * Every encoding of Command, "NAME,arg" plus the terminator, built in
+    * the constructor into fixed buffers.
+    */
+   template <class Command>
+   class Table
+   {
+   public:
+      static_assert(Command::MinArg >= 0 && Command::MinArg <= Command::MaxArg, "argument range");
+
+      // longest encoding plus the terminating zero
+      static const unsigned Size = StrLength(Command::Name()) + 1 + Digits(Command::MaxArg) + 2;
+      static const long Count = Command::MaxArg - Command::MinArg + 1;
+
+      Table()
+      {
+         for (long arg = Command::MinArg; arg <= Command::MaxArg; arg++)
+            len_[arg - Command::MinArg] = Encode(arg, text_[arg - Command::MinArg]);
+      }
+
+      static bool InRange(long arg) { return arg >= Command::MinArg && arg <= Command::MaxArg; }
+      const char* Text(long arg) const { return text_[arg - Command::MinArg]; }
+      unsigned Length(long arg) const { return len_[arg - Command::MinArg]; }
+
+      /**
+       * Reads a command line without its terminator, as a device would.
+       */
+      static bool Parse(const char* line, long& arg)
+      {
+         const unsigned nameLen = StrLength(Command::Name());
+         if (strncmp(line, Command::Name(), nameLen) != 0 || line[nameLen] != ',' || line[nameLen + 1] == 0)
+            return false;
+         char* end;
+         arg = strtol(line + nameLen + 1, &end, 10);
+         return *end == 0 && InRange(arg);
+      }
+
+   private:
+      static unsigned Encode(long arg, char* buf)
+      {
+         unsigned n = 0;
+         for (const char* c = Command::Name(); *c != 0; c++)
+            buf[n++] = *c;
+         buf[n++] = ',';
+         char digits[Digits(Command::MaxArg)];
+         unsigned count = 0;
+         do
+         {
+            digits[count++] = (char) ('0' + arg % 10);
+            arg /= 10;
+         } while (arg > 0);
+         while (count > 0)
+            buf[n++] = digits[--count];
+         buf[n++] = Command::Terminator;
+         buf[n] = 0;
+         return n;
+      }
+
+      char text_[Count][Size];
+      unsigned len_[Count];
+   };
+}
+
+#endif //_AMHPROTOCOL_H_
@@ -0,0 +1,139 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AMHTimer.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Precise wake-ups shared by the Andor AMH200 devices
+// COPYRIGHT:     University of California, San Francisco, 2006
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "AMHTimer.h"
+
+// how long before a deadline the timer thread stops sleeping
+static const std::chrono::microseconds g_SpinWindow(1000);
+
+std::mutex AMHTimerService::instanceLock_;
+AMHTimerService* AMHTimerService::instance_ = 0;
+int AMHTimerService::users_ = 0;
+
+AMHTimerService* AMHTimerService::Acquire()
+{
+   std::lock_guard<std::mutex> guard(instanceLock_);
+   if (instance_ == 0)
+      instance_ = new AMHTimerService();
+   users_++;
+   return instance_;
+}
+
+void AMHTimerService::Release()
+{
+   std::lock_guard<std::mutex> guard(instanceLock_);
+   if (users_ == 0 || --users_ > 0)
+      return;
+
+   {
+      std::lock_guard<std::mutex> lock(instance_->lock_);
+      instance_->stop_ = true;
+   }
+   instance_->wake_.notify_one();
+   instance_->thread_.join();
+   delete instance_;
+   instance_ = 0;
+}
+
+AMHTimerService::AMHTimerService() :
+   registrations_(0), wakeLatency_(std::chrono::microseconds(50)), stop_(false)
+{
+   thread_ = std::thread(&AMHTimerService::Run, this);
+}
+
+void AMHTimerService::WaitUntil(clock::time_point t)
+{
+   // the far part of the wait is an ordinary sleep of the caller
+   if (t - clock::now() > g_SpinWindow)
+      std::this_thread::sleep_until(t - g_SpinWindow);
+
+   Waiter waiter;
+   waiter.due = t;
+   waiter.fired = false;
+   {
+      std::unique_lock<std::mutex> lock(lock_);
+      waiters_.push_back(&waiter);
+      registrations_++;
+      wake_.notify_one();
+      waiter.cv.wait(lock, [&waiter] { return waiter.fired; });
+
+      // keep the lead the timer thread gives at the wake-up latency it sees
+      clock::duration latency = clock::now() - waiter.firedAt;
+      if (latency > g_SpinWindow / 2)
+         latency = g_SpinWindow / 2;
+      wakeLatency_ = (wakeLatency_ * 7 + latency) / 8;
+   }
+
+   while (clock::now() < t)
+      std::this_thread::yield();
+}
+
+void AMHTimerService::Run()
+{
+   std::unique_lock<std::mutex> lock(lock_);
+   while (!stop_)
+   {
+      if (waiters_.empty())
+      {
+         wake_.wait(lock);
+         continue;
+      }
+
+      clock::time_point earliest = waiters_[0]->due;
+      for (size_t i = 1; i < waiters_.size(); i++)
+      {
+         if (waiters_[i]->due < earliest)
+            earliest = waiters_[i]->due;
+      }
+      clock::time_point fireAt = earliest - wakeLatency_;
+      clock::time_point now = clock::now();
+      if (fireAt - now > g_SpinWindow)
+      {
+         wake_.wait_until(lock, fireAt - g_SpinWindow);
+         continue;
+      }
+      if (now < fireAt)
+      {
+         // spin without the lock, so new waiters can register; one may be
+         // due earlier, so a registration ends the spin
+         unsigned registrations = registrations_;
+         lock.unlock();
+         while (clock::now() < fireAt && registrations_ == registrations)
+            std::this_thread::yield();
+         lock.lock();
+         continue;
+      }
+
+      now = clock::now();
+      for (size_t i = 0; i < waiters_.size(); )
+      {
+         Waiter* waiter = waiters_[i];
+         if (waiter->due - wakeLatency_ <= now)
+         {
+            waiter->fired = true;
+            waiter->firedAt = now;
+            waiter->cv.notify_one();
+            waiters_[i] = waiters_.back();
+            waiters_.pop_back();
+         }
+         else
+            i++;
+      }
+   }
+}
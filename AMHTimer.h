@@ -0,0 +1,80 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AMHTimer.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Precise wake-ups for Fire and burst timing, shared by all
+//                Andor AMH200 devices in the process
+// COPYRIGHT:     University of California, San Francisco, 2006
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _AMHTIMER_H_
+#define _AMHTIMER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * The OS scheduler wakes a sleeping thread up to a millisecond late, so a
+ * pulse edge needs a thread spinning for the last stretch.  Rather than
+ * every device's I/O thread spinning on its own, which on a rig with many
+ * light sources keeps that many cores busy and makes the spinners compete,
+ * one thread spins for the earliest deadline of all of them and wakes its
+ * owner.  It wakes owners early by the wake-up latency it has measured, and
+ * the owner spins only for whatever is left of that.
+ *
+ * The thread runs while any device holds the service, see Acquire().
+ */
+class AMHTimerService
+{
+public:
+   typedef std::chrono::steady_clock clock;
+
+   // the service, started by the first caller; every Acquire() needs a
+   // Release()
+   static AMHTimerService* Acquire();
+   static void Release();
+
+   // returns at t, give or take a few microseconds
+   void WaitUntil(clock::time_point t);
+
+private:
+   struct Waiter
+   {
+      clock::time_point due;
+      clock::time_point firedAt;
+      bool fired;
+      std::condition_variable cv;
+   };
+
+   AMHTimerService();
+   void Run();
+
+   std::mutex lock_;
+   std::condition_variable wake_;      // the timer thread: new waiter or stop
+   std::vector<Waiter*> waiters_;
+   std::atomic<unsigned> registrations_;   // lets the spinning thread see new waiters
+   clock::duration wakeLatency_;       // running estimate, guarded by lock_
+   bool stop_;
+   std::thread thread_;
+
+   static std::mutex instanceLock_;
+   static AMHTimerService* instance_;
+   static int users_;
+};
+
+#endif //_AMHTIMER_H_
@@ -0,0 +1,491 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AMHTransport.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Byte transports for the Andor AMH200 adapter
+// COPYRIGHT:     University of California, San Francisco, 2006
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifdef WIN32
+   #include <windows.h>
+#else
+   #include <cerrno>
+   #include <fcntl.h>
+   #include <poll.h>
+   #include <termios.h>
+   #include <unistd.h>
+   #include <sys/ioctl.h>
+   #ifdef __linux__
+      #include <linux/serial.h>
+   #endif
+   #ifdef __APPLE__
+      #include <IOKit/serial/ioss.h>
+   #endif
+#endif
+
+#include "AMHTransport.h"
+#include "AMHProtocol.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+///////////////////////////////////////////////////////////////////////////////
+// AMHSerialTransport
+// ~~~~~~~~~~~~~~~~~~
+
+AMHSerialTransport::AMHSerialTransport(const MM::Device* caller, MM::Core* core, const std::string& port) :
+   caller_(caller), core_(core), port_(port)
+{
+}
+
+int AMHSerialTransport::Write(const char* buf, unsigned len)
+{
+   return core_->WriteToSerial(caller_, port_.c_str(), (const unsigned char*) buf, len);
+}
+
+int AMHSerialTransport::Read(char* buf, unsigned size, unsigned long& read)
+{
+   return core_->ReadFromSerial(caller_, port_.c_str(), (unsigned char*) buf, size, read);
+}
+
+int AMHSerialTransport::Purge()
+{
+   return core_->PurgeSerial(caller_, port_.c_str());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AMHDirectTransport
+// ~~~~~~~~~~~~~~~~~~
+
+#ifdef WIN32
+
+AMHDirectTransport::AMHDirectTransport(const std::string& device, long baud) :
+   device_(device), baud_(baud), handle_(INVALID_HANDLE_VALUE), ioEvent_(0), waitEvent_(0),
+   waitOverlapped_(0), waitPending_(false), eventMask_(0)
+{
+}
+
+AMHDirectTransport::~AMHDirectTransport()
+{
+   if (handle_ != INVALID_HANDLE_VALUE)
+   {
+      if (waitPending_)
+      {
+         DWORD n;
+         CancelIo(handle_);
+         GetOverlappedResult(handle_, (OVERLAPPED*) waitOverlapped_, &n, TRUE);
+      }
+      CloseHandle(handle_);
+   }
+   if (ioEvent_ != 0)
+      CloseHandle(ioEvent_);
+   if (waitEvent_ != 0)
+      CloseHandle(waitEvent_);
+   delete (OVERLAPPED*) waitOverlapped_;
+}
+
+int AMHDirectTransport::Fail(const std::string& what)
+{
+   char messg[64];
+   snprintf(messg, sizeof(messg), " failed, Windows error %lu", (unsigned long) GetLastError());
+   error_ = device_ + ": " + what + messg;
+   return DEVICE_NOT_CONNECTED;
+}
+
+int AMHDirectTransport::Open()
+{
+   // COM10 and above only open with the device namespace prefix
+   std::string name = device_.compare(0, 4, "\\\\.\\") == 0 ? device_ : "\\\\.\\" + device_;
+   handle_ = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+   if (handle_ == INVALID_HANDLE_VALUE)
+      return Fail("CreateFile");
+
+   DCB dcb;
+   memset(&dcb, 0, sizeof(dcb));
+   dcb.DCBlength = sizeof(dcb);
+   if (!GetCommState(handle_, &dcb))
+      return Fail("GetCommState");
+   dcb.BaudRate = (DWORD) baud_;
+   dcb.ByteSize = 8;
+   dcb.Parity = NOPARITY;
+   dcb.StopBits = ONESTOPBIT;
+   dcb.fBinary = TRUE;
+   dcb.fParity = FALSE;
+   dcb.fOutxCtsFlow = FALSE;
+   dcb.fOutxDsrFlow = FALSE;
+   dcb.fDsrSensitivity = FALSE;
+   dcb.fDtrControl = DTR_CONTROL_ENABLE;
+   dcb.fRtsControl = RTS_CONTROL_ENABLE;
+   dcb.fOutX = FALSE;
+   dcb.fInX = FALSE;
+   if (!SetCommState(handle_, &dcb))
+      return Fail("SetCommState");
+
+   // ReadFile returns at once with whatever is there
+   COMMTIMEOUTS timeouts;
+   memset(&timeouts, 0, sizeof(timeouts));
+   timeouts.ReadIntervalTimeout = MAXDWORD;
+   if (!SetCommTimeouts(handle_, &timeouts))
+      return Fail("SetCommTimeouts");
+   if (!SetCommMask(handle_, EV_RXCHAR))
+      return Fail("SetCommMask");
+
+   ioEvent_ = CreateEvent(NULL, TRUE, FALSE, NULL);
+   waitEvent_ = CreateEvent(NULL, TRUE, FALSE, NULL);
+   if (ioEvent_ == 0 || waitEvent_ == 0)
+      return Fail("CreateEvent");
+   OVERLAPPED* ov = new OVERLAPPED;
+   memset(ov, 0, sizeof(*ov));
+   ov->hEvent = waitEvent_;
+   waitOverlapped_ = ov;
+
+   PurgeComm(handle_, PURGE_RXCLEAR | PURGE_TXCLEAR);
+   SetLowLatency();
+   return DEVICE_OK;
+}
+
+void AMHDirectTransport::SetLowLatency()
+{
+   // nothing to do through the Win32 API, see the class comment
+}
+
+int AMHDirectTransport::Write(const char* buf, unsigned len)
+{
+   OVERLAPPED ov;
+   memset(&ov, 0, sizeof(ov));
+   ov.hEvent = ioEvent_;
+   DWORD written = 0;
+   if (!WriteFile(handle_, buf, len, &written, &ov))
+   {
+      if (GetLastError() != ERROR_IO_PENDING || !GetOverlappedResult(handle_, &ov, &written, TRUE))
+         return DEVICE_SERIAL_COMMAND_FAILED;
+   }
+   return written == len ? DEVICE_OK : DEVICE_SERIAL_COMMAND_FAILED;
+}
+
+int AMHDirectTransport::Read(char* buf, unsigned size, unsigned long& read)
+{
+   read = 0;
+   DWORD errors;
+   COMSTAT stat;
+   if (!ClearCommError(handle_, &errors, &stat))
+      return DEVICE_SERIAL_COMMAND_FAILED;
+   if (stat.cbInQue == 0)
+      return DEVICE_OK;
+
+   OVERLAPPED ov;
+   memset(&ov, 0, sizeof(ov));
+   ov.hEvent = ioEvent_;
+   DWORD n = 0;
+   DWORD want = stat.cbInQue < size ? stat.cbInQue : size;
+   if (!ReadFile(handle_, buf, want, &n, &ov))
+   {
+      if (GetLastError() != ERROR_IO_PENDING || !GetOverlappedResult(handle_, &ov, &n, TRUE))
+         return DEVICE_SERIAL_COMMAND_FAILED;
+   }
+   read = n;
+   return DEVICE_OK;
+}
+
+int AMHDirectTransport::Purge()
+{
+   return PurgeComm(handle_, PURGE_RXCLEAR | PURGE_RXABORT) ? DEVICE_OK : DEVICE_SERIAL_COMMAND_FAILED;
+}
+
+/**
+ * Waits for EV_RXCHAR.  The WaitCommEvent stays outstanding across calls
+ * until a character arrives; the queue is checked once it is armed, since
+ * a character that came just before does not signal it.
+ */
+void AMHDirectTransport::WaitReadable(long maxUs)
+{
+   DWORD errors;
+   COMSTAT stat;
+   if (ClearCommError(handle_, &errors, &stat) && stat.cbInQue > 0)
+      return;
+
+   OVERLAPPED* ov = (OVERLAPPED*) waitOverlapped_;
+   if (!waitPending_)
+   {
+      ResetEvent(waitEvent_);
+      if (WaitCommEvent(handle_, &eventMask_, ov))
+         return;
+      if (GetLastError() != ERROR_IO_PENDING)
+      {
+         AMHTransport::WaitReadable(maxUs);
+         return;
+      }
+      waitPending_ = true;
+      if (ClearCommError(handle_, &errors, &stat) && stat.cbInQue > 0)
+         return;
+   }
+
+   if (WaitForSingleObject(waitEvent_, (DWORD) ((maxUs + 999) / 1000)) == WAIT_OBJECT_0)
+   {
+      DWORD n;
+      GetOverlappedResult(handle_, ov, &n, FALSE);
+      waitPending_ = false;
+   }
+}
+
+#else
+
+AMHDirectTransport::AMHDirectTransport(const std::string& device, long baud) :
+   device_(device), baud_(baud), fd_(-1)
+{
+}
+
+AMHDirectTransport::~AMHDirectTransport()
+{
+   if (fd_ >= 0)
+      close(fd_);
+}
+
+int AMHDirectTransport::Fail(const std::string& what)
+{
+   error_ = device_ + ": " + what + " failed, " + strerror(errno);
+   return DEVICE_NOT_CONNECTED;
+}
+
+int AMHDirectTransport::Open()
+{
+   speed_t speed;
+   switch (baud_)
+   {
+      case 9600: speed = B9600; break;
+      case 19200: speed = B19200; break;
+      case 38400: speed = B38400; break;
+      case 57600: speed = B57600; break;
+      case 115200: speed = B115200; break;
+      default:
+         errno = EINVAL;
+         return Fail("setting the baud rate");
+   }
+
+   fd_ = open(device_.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+   if (fd_ < 0)
+      return Fail("open");
+
+   struct termios tio;
+   if (tcgetattr(fd_, &tio) != 0)
+      return Fail("tcgetattr");
+   cfmakeraw(&tio);
+   tio.c_cflag |= CLOCAL | CREAD;
+   tio.c_cflag &= ~CSTOPB;
+#ifdef CRTSCTS
+   tio.c_cflag &= ~CRTSCTS;
+#endif
+   tio.c_cc[VMIN] = 0;
+   tio.c_cc[VTIME] = 0;
+   cfsetispeed(&tio, speed);
+   cfsetospeed(&tio, speed);
+   if (tcsetattr(fd_, TCSANOW, &tio) != 0)
+      return Fail("tcsetattr");
+
+   tcflush(fd_, TCIOFLUSH);
+   SetLowLatency();
+   return DEVICE_OK;
+}
+
+/**
+ * Best effort: without the rights to change them the port still works,
+ * with the driver's default latency.
+ */
+void AMHDirectTransport::SetLowLatency()
+{
+#ifdef __linux__
+   struct serial_struct serial;
+   if (ioctl(fd_, TIOCGSERIAL, &serial) == 0)
+   {
+      serial.flags |= ASYNC_LOW_LATENCY;
+      ioctl(fd_, TIOCSSERIAL, &serial);
+   }
+
+   // ftdi_sio collects received bytes for latency_timer ms, 16 by default
+   std::string name = device_.substr(device_.rfind('/') + 1);
+   std::string timer = "/sys/class/tty/" + name + "/device/latency_timer";
+   FILE* file = fopen(timer.c_str(), "w");
+   if (file != 0)
+   {
+      fputs("1", file);
+      fclose(file);
+   }
+#endif
+#ifdef __APPLE__
+   unsigned long us = 1;
+   ioctl(fd_, IOSSDATALAT, &us);
+#endif
+}
+
+int AMHDirectTransport::Write(const char* buf, unsigned len)
+{
+   while (len > 0)
+   {
+      ssize_t n = write(fd_, buf, len);
+      if (n < 0)
+      {
+         if (errno != EAGAIN && errno != EINTR)
+            return DEVICE_SERIAL_COMMAND_FAILED;
+         struct pollfd pfd = { fd_, POLLOUT, 0 };
+         poll(&pfd, 1, 10);
+         continue;
+      }
+      buf += n;
+      len -= (unsigned) n;
+   }
+   return DEVICE_OK;
+}
+
+int AMHDirectTransport::Read(char* buf, unsigned size, unsigned long& read)
+{
+   read = 0;
+   ssize_t n = ::read(fd_, buf, size);
+   if (n < 0)
+      return errno == EAGAIN || errno == EINTR ? DEVICE_OK : DEVICE_SERIAL_COMMAND_FAILED;
+   read = (unsigned long) n;
+   return DEVICE_OK;
+}
+
+int AMHDirectTransport::Purge()
+{
+   return tcflush(fd_, TCIFLUSH) == 0 ? DEVICE_OK : DEVICE_SERIAL_COMMAND_FAILED;
+}
+
+void AMHDirectTransport::WaitReadable(long maxUs)
+{
+   struct pollfd pfd = { fd_, POLLIN, 0 };
+   poll(&pfd, 1, (int) ((maxUs + 999) / 1000));
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// AMHMockTransport
+// ~~~~~~~~~~~~~~~~
+
+AMHMockTransport::AMHMockTransport() :
+   latencyUs_(1000), jitterUs_(0), errorRate_(0.0), dropRate_(0.0), errorCode_(1), settleUs_(0),
+   level_(-1), rampFrom_(0.0), lineLen_(0), rng_(2463534242u)
+{
+}
+
+int AMHMockTransport::Write(const char* buf, unsigned len)
+{
+   for (unsigned i = 0; i < len; i++)
+   {
+      if (buf[i] == '\r')
+      {
+         Execute();
+         lineLen_ = 0;
+      }
+      else if (lineLen_ + 1 < sizeof(line_))
+      {
+         line_[lineLen_++] = buf[i];
+      }
+   }
+   return DEVICE_OK;
+}
+
+int AMHMockTransport::Read(char* buf, unsigned size, unsigned long& read)
+{
+   read = 0;
+   clock::time_point now = clock::now();
+   while (!replies_.empty() && replies_.front().due <= now)
+   {
+      unsigned len = (unsigned) strlen(replies_.front().text);
+      if (read + len > size)
+         break;
+      memcpy(buf + read, replies_.front().text, len);
+      read += len;
+      replies_.pop_front();
+   }
+   return DEVICE_OK;
+}
+
+int AMHMockTransport::Purge()
+{
+   // answers already on the wire are lost, later ones still arrive
+   clock::time_point now = clock::now();
+   while (!replies_.empty() && replies_.front().due <= now)
+      replies_.pop_front();
+   return DEVICE_OK;
+}
+
+/**
+ * Answers the command collected in line_.
+ */
+void AMHMockTransport::Execute()
+{
+   line_[lineLen_] = 0;
+
+   Reply reply;
+   long level;
+   if (!AMHProtocol::Table<AMHProtocol::Light>::Parse(line_, level))
+      level = -1;
+
+   if (level < 0)
+      strcpy(reply.text, "E,2\r");
+   else if (Random() < errorRate_ * 4294967295.0)
+      snprintf(reply.text, sizeof(reply.text), "E,%ld\r", (long) errorCode_ % 100);
+   else
+   {
+      strcpy(reply.text, "R\r");
+      std::lock_guard<std::mutex> guard(outputLock_);
+      rampFrom_ = GetOutputLocked();
+      rampStart_ = clock::now();
+      level_ = level;
+   }
+   if (dropRate_ > 0.0 && Random() < dropRate_ * 4294967295.0)
+      return;
+
+   long latency = latencyUs_;
+   long jitter = jitterUs_;
+   if (jitter > 0)
+      latency += (long) (Random() % (unsigned) (2 * jitter + 1)) - jitter;
+   if (latency < 0)
+      latency = 0;
+   reply.due = clock::now() + std::chrono::microseconds(latency);
+   if (!replies_.empty() && reply.due < replies_.back().due)
+      reply.due = replies_.back().due;
+   replies_.push_back(reply);
+}
+
+double AMHMockTransport::GetOutput() const
+{
+   std::lock_guard<std::mutex> guard(outputLock_);
+   return GetOutputLocked();
+}
+
+double AMHMockTransport::GetOutputLocked() const
+{
+   long level = level_;
+   if (level < 0)
+      return 0.0;
+   double settle = (double) settleUs_;
+   double elapsed = (double) std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - rampStart_).count();
+   if (elapsed >= settle)
+      return (double) level;
+   return rampFrom_ + (level - rampFrom_) * elapsed / settle;
+}
+
+/**
+ * xorshift32, so runs with the same settings see the same jitter and errors.
+ */
+unsigned AMHMockTransport::Random()
+{
+   rng_ ^= rng_ << 13;
+   rng_ ^= rng_ >> 17;
+   rng_ ^= rng_ << 5;
+   return rng_;
+}
@@ -0,0 +1,189 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AMHTransport.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Byte transports for the Andor AMH200 adapter: the
+//                Micro-Manager serial port, the operating system's serial
+//                device opened directly, and an in-memory mock of the
+//                AMH200 for running without hardware
+// COPYRIGHT:     University of California, San Francisco, 2006
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _AMHTRANSPORT_H_
+#define _AMHTRANSPORT_H_
+
+#include "../../MMDevice/MMDevice.h"
+#include <string>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+/**
+ * Raw byte link to an AMH200.  Only the adapter's I/O thread calls these.
+ * Read() returns whatever has arrived, possibly nothing, without blocking.
+ * WaitReadable() blocks for at most maxUs or until data may have arrived;
+ * transports that cannot wait for data just sleep for the polling interval.
+ */
+class AMHTransport
+{
+public:
+   static const long PollUs = 100;
+
+   virtual ~AMHTransport() {}
+
+   virtual int Write(const char* buf, unsigned len) = 0;
+   virtual int Read(char* buf, unsigned size, unsigned long& read) = 0;
+   virtual int Purge() = 0;
+   virtual void WaitReadable(long maxUs)
+   {
+      std::this_thread::sleep_for(std::chrono::microseconds(maxUs < PollUs ? maxUs : PollUs));
+   }
+};
+
+/**
+ * The Micro-Manager serial port named by the device's Port property.
+ */
+class AMHSerialTransport : public AMHTransport
+{
+public:
+   AMHSerialTransport(const MM::Device* caller, MM::Core* core, const std::string& port);
+
+   int Write(const char* buf, unsigned len);
+   int Read(char* buf, unsigned size, unsigned long& read);
+   int Purge();
+
+private:
+   const MM::Device* caller_;
+   MM::Core* core_;
+   std::string port_;
+};
+
+/**
+ * The serial device of the AMH200's USB-serial bridge, opened by its
+ * operating system name (COM5, /dev/ttyUSB0) instead of through the core's
+ * serial port layer, which costs a core call and a polling interval per
+ * read.  The port is raw 8N1 without flow control.  Reads wait on the
+ * device for the first byte of the answer instead of polling, and Open()
+ * asks the driver for its lowest receive latency: ASYNC_LOW_LATENCY and
+ * the FTDI latency timer on Linux, the receive latency on macOS.  On
+ * Windows the FTDI latency timer is a driver setting, to be lowered to
+ * 1 ms in the port's Advanced properties.
+ */
+class AMHDirectTransport : public AMHTransport
+{
+public:
+   AMHDirectTransport(const std::string& device, long baud);
+   ~AMHDirectTransport();
+
+   // DEVICE_OK, or DEVICE_NOT_CONNECTED with the reason in GetError()
+   int Open();
+   const std::string& GetError() const { return error_; }
+
+   int Write(const char* buf, unsigned len);
+   int Read(char* buf, unsigned size, unsigned long& read);
+   int Purge();
+   void WaitReadable(long maxUs);
+
+private:
+   int Fail(const std::string& what);
+   void SetLowLatency();
+
+   std::string device_;
+   long baud_;
+   std::string error_;
+#ifdef WIN32
+   // HANDLEs and OVERLAPPED, kept opaque so this header needs no windows.h
+   void* handle_;                   // opened for overlapped I/O
+   void* ioEvent_;                  // signals a finished ReadFile/WriteFile
+   void* waitEvent_;                // signals a received character
+   void* waitOverlapped_;           // of the outstanding WaitCommEvent
+   bool waitPending_;
+   unsigned long eventMask_;        // written by the pending WaitCommEvent
+#else
+   int fd_;
+#endif
+};
+
+/**
+ * In-memory model of the AMH200 command set.  LIGHT,n is answered with R
+ * after the configured latency plus uniform jitter; with the configured
+ * probability the answer is E,nn (the configured error code) instead, and
+ * malformed commands get E,2.  With the drop probability a command is
+ * executed but not answered.  Answers keep the order of the commands.  The
+ * light output follows an accepted command linearly over the settle time.
+ * The model is deterministic for a given seed.  The configuration may be
+ * changed from any thread.
+ */
+class AMHMockTransport : public AMHTransport
+{
+public:
+   AMHMockTransport();
+
+   int Write(const char* buf, unsigned len);
+   int Read(char* buf, unsigned size, unsigned long& read);
+   int Purge();
+
+   void SetLatencyUs(long us) { latencyUs_ = us; }
+   long GetLatencyUs() const { return latencyUs_; }
+   void SetJitterUs(long us) { jitterUs_ = us; }
+   long GetJitterUs() const { return jitterUs_; }
+   void SetErrorRate(double rate) { errorRate_ = rate; }
+   double GetErrorRate() const { return errorRate_; }
+   void SetDropRate(double rate) { dropRate_ = rate; }
+   double GetDropRate() const { return dropRate_; }
+   void SetErrorCode(long code) { errorCode_ = code; }
+   long GetErrorCode() const { return errorCode_; }
+   void SetSettleUs(long us) { settleUs_ = us; }
+   long GetSettleUs() const { return settleUs_; }
+
+   // light level the simulated device is at, -1 before the first command
+   long GetLevel() const { return level_; }
+   // light output (0-100) now, taking the settle time into account
+   double GetOutput() const;
+
+private:
+   typedef std::chrono::steady_clock clock;
+
+   struct Reply
+   {
+      clock::time_point due;
+      char text[8];
+   };
+
+   void Execute();
+   double GetOutputLocked() const;
+   unsigned Random();
+
+   std::atomic<long> latencyUs_;
+   std::atomic<long> jitterUs_;
+   std::atomic<double> errorRate_;
+   std::atomic<double> dropRate_;
+   std::atomic<long> errorCode_;
+   std::atomic<long> settleUs_;
+   std::atomic<long> level_;
+
+   // output ramp, read from client threads
+   mutable std::mutex outputLock_;
+   double rampFrom_;
+   clock::time_point rampStart_;
+
+   char line_[32];
+   unsigned lineLen_;
+   std::deque<Reply> replies_;
+   unsigned rng_;
+};
+
+#endif //_AMHTRANSPORT_H_
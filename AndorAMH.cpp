@@ -27,20 +27,149 @@
 
 #include "AndorAMH.h"
 #include <cstdio>
+#include <cctype>
 #include <string>
 #include <math.h>
 #include "../../MMDevice/ModuleInterface.h"
 #include <sstream>
-#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <set>
+#include <fstream>
 
 const char* g_AndorAMH="AndorAMH";
+const char* g_AndorAMHSim="AndorAMH-Sim";
+const char* g_AndorAMHHub="AndorAMH-Hub";
+const char* g_AndorAMHUnit="AndorAMH-Unit";   // followed by the unit number
+const char* g_Units="Units";
+const char* g_BatchCommands="Batch Commands";
+const char* g_Async="Asynchronous";
+const char* g_ForceResend="Force Resend";
+const char* g_FireOnTime="Fire On-Time (ms)";
+const char* g_HoldOpen="Hold Open Below (ms)";
+const char* g_ArmedIntensity="Armed Intensity";
+const char* g_Presets="Presets";
+const char* g_PresetFile="Preset File";
+const char* g_Preset="Preset";
+const char* g_NoPreset="None";
+const char* g_HealthInterval="Health Check Interval (ms)";
+const char* g_LinkState="Link State";
+const char* g_LinkLatency="Link Latency (ms)";
+const char* g_LinkUnknown="Unknown";
+const char* g_LinkUp="OK";
+const char* g_LinkLost="Lost";
+const char* g_PipelineDepth="Pipeline Depth";
+const char* g_ResetStats="Reset Stats";
+const char* g_Dose="Dose (percent-s)";
+const char* g_OnTime="On Time (s)";
+const char* g_DoseTag="Dose Tag";
+const char* g_TagDose="Tag Dose (percent-s)";
+const char* g_DosePerTag="Dose Per Tag";
+const char* g_ResetDose="Reset Dose";
+const char* g_AnswerTimeout="Answer Timeout (ms)";
+const char* g_Retry="Retry On Timeout";
+const char* g_Trace="Trace";
+const char* g_TraceFile="Trace File";
+const char* g_FlushTrace="Flush Trace";
+const char* g_FlushTraceOnError="Flush Trace On Error";
+const char* g_SettleMode="Settle Mode";
+const char* g_Manual="Manual";
+const char* g_Auto="Auto";
+const char* g_SettlePercentile="Settle Percentile";
+const char* g_SettleTime="Settle Time (ms)";
+const char* g_CalibrationSensor="Calibration Sensor";
+const char* g_CalibrationCycles="Calibration Cycles";
+const char* g_CalibrateSettle="Calibrate Settle";
+const char* g_Transport="Transport";
+const char* g_SerialTransport="Serial Port";
+const char* g_MockTransport="Mock";
+const char* g_DirectTransport="Direct";
+const char* g_DirectBaudRate="Direct Baud Rate";
+const long g_DirectBaudRates[] = { 9600, 19200, 38400, 57600, 115200 };
+const char* g_MockLatency="Mock Latency (us)";
+const char* g_MockJitter="Mock Jitter (us)";
+const char* g_MockErrorRate="Mock Error Rate";
+const char* g_MockDropRate="Mock Drop Rate";
+const char* g_MockErrorCode="Mock Error Code";
+const char* g_MockSettle="Mock Settle (ms)";
+const char* g_MockOutput="Mock Light Output";
+const char* g_BurstWidth="Burst Pulse Width (ms)";
+const char* g_BurstPeriod="Burst Period (ms)";
+const char* g_BurstCount="Burst Count";
+const char* g_BurstIntensity="Burst Intensity";
+const char* g_StartBurst="Start Burst";
+const char* g_StopBurst="Stop Burst";
+const char* g_BurstResult="Burst Result";
+const char* g_RampStart="Ramp Start";
+const char* g_RampEnd="Ramp End";
+const char* g_RampDuration="Ramp Duration (ms)";
+const char* g_RampShape="Ramp Shape";
+const char* g_Linear="Linear";
+const char* g_Exponential="Exponential";
+const char* g_StartRamp="Start Ramp";
+const char* g_StopRamp="Stop Ramp";
+const char* g_RampResult="Ramp Result";
+const char* g_TriggerMode="Trigger Mode";
+const char* g_Internal="Internal";
+const char* g_External="External";
+
+// with the camera gating the light there is no limit on the host side
+const long g_MaxGatedSequence = 1000000;
+const char* g_No="No";
+const char* g_Yes="Yes";
+
+///////////////////////////////////////////////////////////////////////////////
+// File-local helpers
+///////////////////////////////////////////////////////////////////////////////
+
+static std::string UnitName(long unit)
+{
+   return std::string(g_AndorAMHUnit) + CDeviceUtils::ConvertToString(unit);
+}
+
+// ports in use by initialized devices of this module
+static std::mutex g_PortsLock;
+static std::set<std::string> g_Ports;
+
+// default Trace File of a device: one per label, so the units of a hub
+// and several instances do not overwrite each other's traces
+static std::string TraceFileName(const char* label)
+{
+   std::string name = g_AndorAMH;
+   if (label[0] != 0)
+   {
+      name += "-";
+      for (const char* c = label; *c != 0; c++)
+         name += isalnum((unsigned char) *c) || *c == '-' ? *c : '_';
+   }
+   return name + "-trace.bin";
+}
+
+static bool ClaimPort(const std::string& port)
+{
+   std::lock_guard<std::mutex> guard(g_PortsLock);
+   return g_Ports.insert(port).second;
+}
+
+static void ReleasePort(const std::string& port)
+{
+   std::lock_guard<std::mutex> guard(g_PortsLock);
+   g_Ports.erase(port);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 // Exported MMDevice API
 ///////////////////////////////////////////////////////////////////////////////
+
 MODULE_API void InitializeModuleData()
 {
    RegisterDevice(g_AndorAMH, MM::ShutterDevice, "Andor AMH200-FOS shutter");
+   RegisterDevice(g_AndorAMHSim, MM::ShutterDevice, "Simulated Andor AMH200-FOS shutter");
+   RegisterDevice(g_AndorAMHHub, MM::HubDevice, "Andor AMH200-FOS hub for several units");
+   for (long unit = 1; unit <= AMH_MAX_UNITS; unit++)
+   {
+      std::string desc = std::string("Andor AMH200-FOS unit ") + CDeviceUtils::ConvertToString(unit) + " on the hub";
+      RegisterDevice(UnitName(unit).c_str(), MM::ShutterDevice, desc.c_str());
+   }
 }
 
 MODULE_API MM::Device* CreateDevice(const char* deviceName)
@@ -53,6 +182,20 @@ MODULE_API MM::Device* CreateDevice(const char* deviceName)
       AndorAMH* s = new AndorAMH();
       return s;
    }
+   else if (strcmp(deviceName, g_AndorAMHSim) == 0)
+   {
+      AndorAMH* s = new AndorAMH(true);
+      return s;
+   }
+   else if (strcmp(deviceName, g_AndorAMHHub) == 0)
+   {
+      return new AndorAMHHub();
+   }
+   for (long unit = 1; unit <= AMH_MAX_UNITS; unit++)
+   {
+      if (UnitName(unit) == deviceName)
+         return new AndorAMH(false, unit);
+   }
    return 0;
 }
 
@@ -65,28 +208,79 @@ MODULE_API void DeleteDevice(MM::Device* pDevice)
 // AndorAMH 
 // ~~~~~~~~
 
-AndorAMH::AndorAMH() :
-   initialized_(false), changedTime_(0.0), intensity_(1),
-   curState_(false),  port_("Andor-AMH200-FOS")  //Included port string, as this should always be correct
+AndorAMH::AndorAMH(bool simulated, long unit) :
+   autoSettle_(false), settlePercentile_(99.0), settleCalibrated_(false), calibrationCycles_(20),
+   simulated_(simulated), unit_(unit), hub_(0), initialized_(false),
+   port_("Andor-AMH200-FOS"),  //Included port string, as this should always be correct
+   intensity_(100), armedIntensity_(0), preset_(g_NoPreset), curState_(false),
+   externalTrigger_(false), sequenceRunning_(false),
+   async_(false), ioInFlight_(false), stopIO_(false), asyncError_(DEVICE_OK), pipelineDepth_(1),
+   lastLevel_(-1), fireOnTimeMs_(0.0), holdOpenMs_(0.0), holdPending_(false), healthIntervalMs_(0),
+   checkLevel_(-1), linkState_(LinkUnknown), linkLatencyUs_(0),
+   doseLevel_(0), doseSince_(std::chrono::steady_clock::now()), dose_(0.0), onTime_(0.0), tagDose_(0), snapshot_(0),
+   snapshotEpoch_(std::chrono::steady_clock::now()), roundTripMs_(0.0),
+   transportName_(simulated ? g_MockTransport : g_SerialTransport), baudRate_(AMH_DIRECT_BAUD), transport_(0), mock_(0),
+   timer_(0), portClaimed_(false),
+   burstWidthMs_(5.0), burstPeriodMs_(100.0), burstCount_(10), burstIntensity_(100), burstStops_(0),
+   rampStart_(0), rampEnd_(100), rampMs_(1000.0), rampExponential_(false), rampStops_(0),
+   rxLen_(0), staleReplies_(0), answerTimeoutMs_(AMH_ANSWER_TIMEOUT_MS), retry_(false),
+   timeouts_(0), retries_(0), resynced_(false), flushTraceOnError_(false),
+   traceFlushPending_(false)
 {
    InitializeDefaultErrorMessages();
    SetErrorText(ERR_UNRECOGNIZED_ANSWER, "Unrecognised answer received from the device");
+   SetErrorText(ERR_NO_CALIBRATION_SENSOR, "Calibration Sensor does not name a loaded signal input device");
+   SetErrorText(ERR_CALIBRATION_NO_SIGNAL, "The calibration sensor did not see the light switch");
+   SetErrorText(ERR_GATED_SEQUENCE, "In External trigger mode the camera gates the light, so a State sequence can only keep it open");
+   SetErrorText(ERR_NO_HUB, "The unit is not attached to an AndorAMH-Hub");
+   SetErrorText(ERR_UNIT_NOT_ON_HUB, "The hub has fewer Units than this unit's number");
+   SetErrorText(ERR_TRACE_FILE, "Could not write the trace file");
+   SetErrorText(ERR_PRESET_FILE, "The Preset File cannot be read or has a line that is not name=level (0-100)");
+   SetErrorText(ERR_PORT_IN_USE, "Another AndorAMH device already uses this port");
+   SetErrorText(ERR_DIRECT_OPEN, "The Direct transport could not open the serial device named by Port (see the log)");
 
    // create pre-initialization properties
    // ------------------------------------
 
    // Name
-   CreateProperty(MM::g_Keyword_Name, g_AndorAMH, MM::String, true);
+   char name[MM::MaxStrLength];
+   GetName(name);
+   CreateProperty(MM::g_Keyword_Name, name, MM::String, true);
 
    // Description
-   CreateProperty(MM::g_Keyword_Description, "Andor AMH200-FOS shutter", MM::String, true);
+   CreateProperty(MM::g_Keyword_Description,
+      simulated_ ? "Simulated Andor AMH200-FOS shutter" : "Andor AMH200-FOS shutter", MM::String, true);
+
+   // Port and Transport; those of a hub unit are set on the hub
+   if (unit_ == 0)
+   {
+      CPropertyAction* pAct = new CPropertyAction (this, &AndorAMH::OnPort);
+      CreateProperty(MM::g_Keyword_Port, "Andor-AMH200-FOS", MM::String, false, pAct, true);
+
+      // Transport: the serial port, the operating system's serial device
+      // named by Port, or an in-memory AMH200 for running without hardware.
+      // The simulated device has only the latter
+      pAct = new CPropertyAction (this, &AndorAMH::OnTransport);
+      CreateProperty(g_Transport, transportName_.c_str(), MM::String, false, pAct, true);
+      if (!simulated_)
+      {
+         AddAllowedValue(g_Transport, g_SerialTransport);
+         AddAllowedValue(g_Transport, g_DirectTransport);
+      }
+      AddAllowedValue(g_Transport, g_MockTransport);
 
-   // Port
-   CPropertyAction* pAct = new CPropertyAction (this, &AndorAMH::OnPort);
-   CreateProperty(MM::g_Keyword_Port, "Andor-AMH200-FOS", MM::String, false, pAct, true);
+      if (!simulated_)
+      {
+         pAct = new CPropertyAction (this, &AndorAMH::OnDirectBaudRate);
+         CreateProperty(g_DirectBaudRate, CDeviceUtils::ConvertToString(baudRate_), MM::Integer, false, pAct, true);
+         for (int i = 0; i < 5; i++)
+            AddAllowedValue(g_DirectBaudRate, CDeviceUtils::ConvertToString(g_DirectBaudRates[i]));
+      }
+   }
 
    EnableDelay();
 
+   tagDose_ = &doseByTag_[doseTag_];
 }
 
 AndorAMH::~AndorAMH()
@@ -96,11 +290,32 @@ AndorAMH::~AndorAMH()
 
 void AndorAMH::GetName(char* name) const
 {
-   CDeviceUtils::CopyLimitedString(name, g_AndorAMH);
+   if (unit_ > 0)
+      CDeviceUtils::CopyLimitedString(name, UnitName(unit_).c_str());
+   else
+      CDeviceUtils::CopyLimitedString(name, simulated_ ? g_AndorAMHSim : g_AndorAMH);
 }
 
 int AndorAMH::Initialize()
 {
+   // a hub unit takes its port and transport from the hub; a missing hub
+   // or one of another adapter leaves hub 0
+   if (unit_ > 0)
+   {
+      AndorAMHHub* hub = dynamic_cast<AndorAMHHub*>(GetParentHub());
+      if (hub == 0)
+         return ERR_NO_HUB;
+      if (unit_ > hub->GetUnits())
+         return ERR_UNIT_NOT_ON_HUB;
+      char hubLabel[MM::MaxStrLength];
+      hub->GetLabel(hubLabel);
+      SetParentID(hubLabel);
+      port_ = hub->GetUnitPort(unit_);
+      transportName_ = hub->GetTransportName();
+      baudRate_ = hub->GetBaudRate();
+      hub_ = hub;
+   }
+
    // State
    // -----
    CPropertyAction* pAct = new CPropertyAction (this, &AndorAMH::OnState);
@@ -128,185 +343,3004 @@ int AndorAMH::Initialize()
    if (ret != DEVICE_OK)
       return ret;
 
-   ret = UpdateStatus();
+   // Armed Intensity: taken by the next opening, see ArmIntensity()
+   // ---------------
+   pAct = new CPropertyAction (this, &AndorAMH::OnArmedIntensity);
+   ret = CreateProperty(g_ArmedIntensity, "0", MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_ArmedIntensity, 0, AMH_MAX_LEVEL);
    if (ret != DEVICE_OK)
       return ret;
-   
-   // set initial values
-   SetProperty(MM::g_Keyword_State, curState_ ? "1" : "0");
-   
-   // Set Time for Busy flag
-   changedTime_ = GetCurrentMMTime();
-   
-   initialized_ = true;
 
-   return DEVICE_OK;
-}
+   // Presets: "name=level;..." and/or a file of "name=level" lines, level 0
+   // for off; Preset applies one
+   // -------
+   pAct = new CPropertyAction (this, &AndorAMH::OnPresets);
+   ret = CreateProperty(g_Presets, "", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
 
-int AndorAMH::Shutdown()
-{
-   if (initialized_)
+   pAct = new CPropertyAction (this, &AndorAMH::OnPresetFile);
+   ret = CreateProperty(g_PresetFile, "", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnPreset);
+   ret = CreateProperty(g_Preset, g_NoPreset, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_Preset, g_NoPreset);
+
+   // Asynchronous
+   // ------------
+   pAct = new CPropertyAction (this, &AndorAMH::OnAsync);
+   ret = CreateProperty(g_Async, g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_Async, g_No);
+   AddAllowedValue(g_Async, g_Yes);
+
+   // Force Resend
+   // ------------
+   pAct = new CPropertyAction (this, &AndorAMH::OnForceResend);
+   ret = CreateProperty(g_ForceResend, g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_ForceResend, g_No);
+   AddAllowedValue(g_ForceResend, g_Yes);
+
+   // Pipeline Depth
+   // --------------
+   // number of LIGHT commands sent back to back before waiting for acks
+   pAct = new CPropertyAction (this, &AndorAMH::OnPipelineDepth);
+   ret = CreateProperty(g_PipelineDepth, "1", MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_PipelineDepth, 1, AMH_MAX_PIPELINE);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // Answer Timeout and Retry On Timeout
+   // -----------------------------------
+   // how long to wait for an ack, and whether a command whose ack does not
+   // come is sent once more after resynchronising the port
+   pAct = new CPropertyAction (this, &AndorAMH::OnAnswerTimeout);
+   ret = CreateProperty(g_AnswerTimeout, CDeviceUtils::ConvertToString(AMH_ANSWER_TIMEOUT_MS), MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_AnswerTimeout, 1, 10000);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnRetry);
+   ret = CreateProperty(g_Retry, g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_Retry, g_No);
+   AddAllowedValue(g_Retry, g_Yes);
+
+   // Latency statistics
+   // ------------------
+   // per stage: count, min, p50, p99 and max of acknowledged commands
+   const char* stages[NumStages] = { "Send", "Ack Wait", "Total" };
+   const char* stats[] = { "Count", "Min (ms)", "P50 (ms)", "P99 (ms)", "Max (ms)" };
+   for (long stage = 0; stage < NumStages; stage++)
    {
-      int ret=SetShutterPosition(false);   // To make sure the shutter is closed before quitting MM
+      for (long stat = 0; stat < 5; stat++)
+      {
+         std::string name = std::string("Latency ") + stages[stage] + " " + stats[stat];
+         CPropertyActionEx* pActEx = new CPropertyActionEx (this, &AndorAMH::OnLatencyStat, stage * 8 + stat);
+         ret = CreateProperty(name.c_str(), "0", stat == 0 ? MM::Integer : MM::Float, true, pActEx);
+         if (ret != DEVICE_OK)
+            return ret;
+      }
+   }
+
+   const char* answerStats[] = { "Answer Timeouts", "Answer Retries" };
+   for (long stat = 0; stat < 2; stat++)
+   {
+      CPropertyActionEx* pActEx = new CPropertyActionEx (this, &AndorAMH::OnAnswerStat, stat);
+      ret = CreateProperty(answerStats[stat], "0", MM::Integer, true, pActEx);
       if (ret != DEVICE_OK)
          return ret;
-      initialized_ = false;
    }
-   return DEVICE_OK;
-}
 
-bool AndorAMH::Busy()
-{
-   MM::MMTime interval = GetCurrentMMTime() - changedTime_;
-   MM::MMTime delay(GetDelayMs()*1000.0);
-   if (interval < delay)
-      return true;
-   else
-      return false;
-}
+   pAct = new CPropertyAction (this, &AndorAMH::OnResetStats);
+   ret = CreateProperty(g_ResetStats, g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_ResetStats, g_No);
+   AddAllowedValue(g_ResetStats, g_Yes);
 
-int AndorAMH::SetOpen(bool open)
-{
-   long pos;
-   if (open)
-      pos = 1;
-   else
-      pos = 0;
-   return SetProperty(MM::g_Keyword_State, CDeviceUtils::ConvertToString(pos));
-}
+   // Command trace
+   // -------------
+   pAct = new CPropertyAction (this, &AndorAMH::OnTrace);
+   ret = CreateProperty(g_Trace, g_Yes, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_Trace, g_No);
+   AddAllowedValue(g_Trace, g_Yes);
 
-int AndorAMH::GetOpen(bool& open)
-{
-   char buf[MM::MaxStrLength];
-   int ret = GetProperty(MM::g_Keyword_State, buf);
+   char label[MM::MaxStrLength];
+   GetLabel(label);
+   traceFile_ = TraceFileName(label);
+   pAct = new CPropertyAction (this, &AndorAMH::OnTraceFile);
+   ret = CreateProperty(g_TraceFile, traceFile_.c_str(), MM::String, false, pAct);
    if (ret != DEVICE_OK)
       return ret;
-   long pos = atol(buf);
-   pos == 1 ? open = true : open = false;
 
-   return DEVICE_OK;
-}
+   pAct = new CPropertyAction (this, &AndorAMH::OnFlushTrace);
+   ret = CreateProperty(g_FlushTrace, g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_FlushTrace, g_No);
+   AddAllowedValue(g_FlushTrace, g_Yes);
 
-int AndorAMH::Fire(double /*deltaT*/)
-{
-   return DEVICE_UNSUPPORTED_COMMAND;
-}
+   pAct = new CPropertyAction (this, &AndorAMH::OnFlushTraceOnError);
+   ret = CreateProperty(g_FlushTraceOnError, g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_FlushTraceOnError, g_No);
+   AddAllowedValue(g_FlushTraceOnError, g_Yes);
 
-/**
- * Sends an open/close command through the serial port.
- */
-int AndorAMH::SetShutterPosition(bool state)
-{
+   // Light dose: intensity (percent) times on-time, integrated over the
+   // acknowledged transitions, in total and per Dose Tag
+   // ----------
+   pAct = new CPropertyAction (this, &AndorAMH::OnDose);
+   ret = CreateProperty(g_Dose, "0.0", MM::Float, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
 
-   // First Clear serial port from previous stuff, now using MM's function
-   int ret = PurgeComPort(port_.c_str());
+   pAct = new CPropertyAction (this, &AndorAMH::OnOnTime);
+   ret = CreateProperty(g_OnTime, "0.0", MM::Float, true, pAct);
    if (ret != DEVICE_OK)
       return ret;
 
-   std::ostringstream command;
-   command << "LIGHT," << (state ? intensity_ : 0);
+   pAct = new CPropertyAction (this, &AndorAMH::OnDoseTag);
+   ret = CreateProperty(g_DoseTag, "", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
 
-   // send command
-   ret = SendSerialCommand(port_.c_str(), command.str().c_str(), "\r");
+   pAct = new CPropertyAction (this, &AndorAMH::OnTagDose);
+   ret = CreateProperty(g_TagDose, "0.0", MM::Float, true, pAct);
    if (ret != DEVICE_OK)
       return ret;
 
-   // block/wait for acknowledge, or until we time out;
-   std::string answer;
-   ret = GetSerialAnswer(port_.c_str(), "\r", answer);
+   pAct = new CPropertyAction (this, &AndorAMH::OnDosePerTag);
+   ret = CreateProperty(g_DosePerTag, "", MM::String, true, pAct);
    if (ret != DEVICE_OK)
       return ret;
 
-   // Set timer for Busy signal
-   changedTime_ = GetCurrentMMTime();
+   pAct = new CPropertyAction (this, &AndorAMH::OnResetDose);
+   ret = CreateProperty(g_ResetDose, g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_ResetDose, g_No);
+   AddAllowedValue(g_ResetDose, g_Yes);
 
-   if (answer.substr(0,1).compare("R") == 0)
-   {
-      return DEVICE_OK;
-   }
-   else if (answer.substr(0, 1).compare("E") == 0 && answer.length() > 2)
-   {
-      int errNo = atoi(answer.substr(2).c_str());
-      std::string messg = boost::lexical_cast<std::string,int>(errNo);
-      LogMessage("Error in received answer, giving code: " + (messg),true);
-      return ERR_OFFSET + errNo;
-   }
+   // Settle time
+   // -----------
+   // Manual uses the Delay property; Auto uses the calibrated switching time,
+   // or until a calibration has run the measured ack latency, never less
+   // than Delay
+   pAct = new CPropertyAction (this, &AndorAMH::OnSettleMode);
+   ret = CreateProperty(g_SettleMode, g_Manual, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_SettleMode, g_Manual);
+   AddAllowedValue(g_SettleMode, g_Auto);
 
-   return DEVICE_OK;
-}
+   pAct = new CPropertyAction (this, &AndorAMH::OnSettlePercentile);
+   ret = CreateProperty(g_SettlePercentile, "99.0", MM::Float, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_SettlePercentile, 50.0, 100.0);
+   if (ret != DEVICE_OK)
+      return ret;
 
-///////////////////////////////////////////////////////////////////////////////
-// Action handlers
-///////////////////////////////////////////////////////////////////////////////
+   pAct = new CPropertyAction (this, &AndorAMH::OnSettleTime);
+   ret = CreateProperty(g_SettleTime, "0.0", MM::Float, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
 
-int AndorAMH::OnState(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-   if (eAct == MM::BeforeGet)
-   {
-      // will return cached value
-   }
-   else if (eAct == MM::AfterSet)
-   {
-      long pos;
-      pProp->Get(pos);
-      curState_ = pos == 0 ? false : true;
+   // photodiode (any signal input device) watching the light for calibration
+   pAct = new CPropertyAction (this, &AndorAMH::OnCalibrationSensor);
+   ret = CreateProperty(g_CalibrationSensor, "", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
 
-      // apply the value
-      return SetShutterPosition(curState_);
-   }
+   pAct = new CPropertyAction (this, &AndorAMH::OnCalibrationCycles);
+   ret = CreateProperty(g_CalibrationCycles, "20", MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_CalibrationCycles, 1, 1000);
+   if (ret != DEVICE_OK)
+      return ret;
 
-   return DEVICE_OK;
-}
+   pAct = new CPropertyAction (this, &AndorAMH::OnCalibrateSettle);
+   ret = CreateProperty(g_CalibrateSettle, g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_CalibrateSettle, g_No);
+   AddAllowedValue(g_CalibrateSettle, g_Yes);
 
-int AndorAMH::OnPort(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-   if (eAct == MM::BeforeGet)
-   {
-      pProp->Set(port_.c_str());
-   }
-   else if (eAct == MM::AfterSet)
-   {
-      if (initialized_)
-      {
-         // revert
-         pProp->Set(port_.c_str());
-         return ERR_PORT_CHANGE_FORBIDDEN;
-      }
+   // Trigger Mode
+   // ------------
+   pAct = new CPropertyAction (this, &AndorAMH::OnTriggerMode);
+   ret = CreateProperty(g_TriggerMode, g_Internal, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_TriggerMode, g_Internal);
+   AddAllowedValue(g_TriggerMode, g_External);
 
-      pProp->Get(port_);
-   }
+   // Fire On-Time
+   // ------------
+   pAct = new CPropertyAction (this, &AndorAMH::OnFireOnTime);
+   ret = CreateProperty(g_FireOnTime, "0.0", MM::Float, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
 
-   return DEVICE_OK;
-}
+   // Hold Open Below: closes followed by an open within this many ms are
+   // skipped, the light stays on.  0 switches it off
+   // ------------------------------------------------
+   pAct = new CPropertyAction (this, &AndorAMH::OnHoldOpen);
+   ret = CreateProperty(g_HoldOpen, "0.0", MM::Float, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_HoldOpen, 0.0, 10000.0);
+   if (ret != DEVICE_OK)
+      return ret;
 
-int AndorAMH::OnDelay(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-   if (eAct == MM::BeforeGet)
-   {
-      pProp->Set(this->GetDelayMs());
-   }
-   else if (eAct == MM::AfterSet)
-   {
-      double delay;
-      pProp->Get(delay);
-      this->SetDelayMs(delay);
-   }
+   // Health check: after AMH_HEALTH_QUIET times this many ms without
+   // traffic, and then every this many ms, the I/O thread resends the
+   // acknowledged level to see that the unit still answers.  0 switches
+   // it off
+   // -----------------
+   pAct = new CPropertyAction (this, &AndorAMH::OnHealthInterval);
+   ret = CreateProperty(g_HealthInterval, "0", MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_HealthInterval, 0, 3600000);
+   if (ret != DEVICE_OK)
+      return ret;
 
-   return DEVICE_OK;
-}
+   pAct = new CPropertyAction (this, &AndorAMH::OnLinkState);
+   ret = CreateProperty(g_LinkState, g_LinkUnknown, MM::String, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
 
-int AndorAMH::OnIntensity(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-   if (eAct == MM::BeforeGet)
-   {
-      pProp->Set(intensity_);
-   }
-   else if (eAct == MM::AfterSet)
+   pAct = new CPropertyAction (this, &AndorAMH::OnLinkLatency);
+   ret = CreateProperty(g_LinkLatency, "0.0", MM::Float, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // Mock transport settings
+   // -----------------------
+   if (transportName_ == g_MockTransport)
    {
-      pProp->Get(intensity_);
-      if (curState_)
-         return SetShutterPosition(curState_);
+      pAct = new CPropertyAction (this, &AndorAMH::OnMockLatency);
+      ret = CreateProperty(g_MockLatency, "1000", MM::Integer, false, pAct);
+      if (ret != DEVICE_OK)
+         return ret;
+      pAct = new CPropertyAction (this, &AndorAMH::OnMockJitter);
+      ret = CreateProperty(g_MockJitter, "0", MM::Integer, false, pAct);
+      if (ret != DEVICE_OK)
+         return ret;
+      pAct = new CPropertyAction (this, &AndorAMH::OnMockErrorRate);
+      ret = CreateProperty(g_MockErrorRate, "0.0", MM::Float, false, pAct);
+      if (ret != DEVICE_OK)
+         return ret;
+      ret = SetPropertyLimits(g_MockErrorRate, 0.0, 1.0);
+      if (ret != DEVICE_OK)
+         return ret;
+      pAct = new CPropertyAction (this, &AndorAMH::OnMockDropRate);
+      ret = CreateProperty(g_MockDropRate, "0.0", MM::Float, false, pAct);
+      if (ret != DEVICE_OK)
+         return ret;
+      ret = SetPropertyLimits(g_MockDropRate, 0.0, 1.0);
+      if (ret != DEVICE_OK)
+         return ret;
+      pAct = new CPropertyAction (this, &AndorAMH::OnMockErrorCode);
+      ret = CreateProperty(g_MockErrorCode, "1", MM::Integer, false, pAct);
+      if (ret != DEVICE_OK)
+         return ret;
+      ret = SetPropertyLimits(g_MockErrorCode, 1, 99);
+      if (ret != DEVICE_OK)
+         return ret;
+      pAct = new CPropertyAction (this, &AndorAMH::OnMockSettle);
+      ret = CreateProperty(g_MockSettle, "0.0", MM::Float, false, pAct);
+      if (ret != DEVICE_OK)
+         return ret;
+      pAct = new CPropertyAction (this, &AndorAMH::OnMockOutput);
+      ret = CreateProperty(g_MockOutput, "0.0", MM::Float, true, pAct);
+      if (ret != DEVICE_OK)
+         return ret;
    }
 
-   return DEVICE_OK;
-}
\ No newline at end of file
+   // Burst: a train of Burst Count pulses, timed on the I/O thread
+   // -------------------------------------------------------------
+   pAct = new CPropertyAction (this, &AndorAMH::OnBurstWidth);
+   ret = CreateProperty(g_BurstWidth, "5.0", MM::Float, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_BurstWidth, 0.1, 10000.0);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnBurstPeriod);
+   ret = CreateProperty(g_BurstPeriod, "100.0", MM::Float, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_BurstPeriod, 0.2, 3600000.0);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnBurstCount);
+   ret = CreateProperty(g_BurstCount, "10", MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_BurstCount, 1, 1000000);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnBurstIntensity);
+   ret = CreateProperty(g_BurstIntensity, "100", MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_BurstIntensity, 1, AMH_MAX_LEVEL);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnStartBurst);
+   ret = CreateProperty(g_StartBurst, g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_StartBurst, g_No);
+   AddAllowedValue(g_StartBurst, g_Yes);
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnStopBurst);
+   ret = CreateProperty(g_StopBurst, g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_StopBurst, g_No);
+   AddAllowedValue(g_StopBurst, g_Yes);
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnBurstResult);
+   ret = CreateProperty(g_BurstResult, "", MM::String, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // Ramp: intensity steps from Ramp Start to Ramp End, sent by the I/O
+   // thread as fast as the acks come back
+   // ------------------------------------------------------------------
+   pAct = new CPropertyAction (this, &AndorAMH::OnRampStart);
+   ret = CreateProperty(g_RampStart, "0", MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_RampStart, 0, AMH_MAX_LEVEL);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnRampEnd);
+   ret = CreateProperty(g_RampEnd, "100", MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_RampEnd, 0, AMH_MAX_LEVEL);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnRampDuration);
+   ret = CreateProperty(g_RampDuration, "1000.0", MM::Float, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = SetPropertyLimits(g_RampDuration, 1.0, 3600000.0);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnRampShape);
+   ret = CreateProperty(g_RampShape, g_Linear, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_RampShape, g_Linear);
+   AddAllowedValue(g_RampShape, g_Exponential);
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnStartRamp);
+   ret = CreateProperty(g_StartRamp, g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_StartRamp, g_No);
+   AddAllowedValue(g_StartRamp, g_Yes);
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnStopRamp);
+   ret = CreateProperty(g_StopRamp, g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_StopRamp, g_No);
+   AddAllowedValue(g_StopRamp, g_Yes);
+
+   pAct = new CPropertyAction (this, &AndorAMH::OnRampResult);
+   ret = CreateProperty(g_RampResult, "", MM::String, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // serial I/O worker; two devices on one port would take each other's
+   // answers
+   if (transportName_ != g_MockTransport)
+   {
+      if (!ClaimPort(port_))
+         return ERR_PORT_IN_USE;
+      portClaimed_ = true;
+   }
+   if (transportName_ == g_MockTransport)
+      transport_ = mock_ = new AMHMockTransport();
+   else if (transportName_ == g_DirectTransport)
+   {
+      AMHDirectTransport* direct = new AMHDirectTransport(port_, baudRate_);
+      transport_ = direct;
+      if (direct->Open() != DEVICE_OK)
+      {
+         LogMessage(direct->GetError(), false);
+         return ERR_DIRECT_OPEN;
+      }
+   }
+   else
+      transport_ = new AMHSerialTransport(this, GetCoreCallback(), port_);
+   timer_ = AMHTimerService::Acquire();
+   stopIO_ = false;
+   ioThread_ = std::thread(&AndorAMH::IOWorker, this);
+   traceThread_ = std::thread(&AndorAMH::TraceWriter, this);
+
+   ret = UpdateStatus();
+   if (ret != DEVICE_OK)
+      return ret;
+   
+   // The AMH200 cannot be queried, so the handshake is a single LIGHT,0: it
+   // checks that the unit answers and puts it in the state the properties
+   // start from.  Its ack seeds lastLevel_ and the Busy timer, so the State
+   // 0 a configuration loads next is redundant and never sent
+   PublishSetting();
+   ret = SetShutterPosition(false, true);
+   if (ret != DEVICE_OK)
+      return ret;
+   
+   initialized_ = true;
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::Shutdown()
+{
+   int ret = DEVICE_OK;
+   hub_ = 0;   // the hub may be gone already; the close below waits for its ack
+   if (initialized_)
+   {
+      burstStops_++;   // or the close below waits for the whole train
+      rampStops_++;
+      ret=SetShutterPosition(false);   // To make sure the shutter is closed before quitting MM
+      initialized_ = false;
+   }
+   // the worker goes even if the close failed, or it would outlive the device
+   StopIOWorker();
+   delete transport_;
+   transport_ = 0;
+   mock_ = 0;
+   if (timer_ != 0)
+   {
+      AMHTimerService::Release();
+      timer_ = 0;
+   }
+   if (portClaimed_)
+   {
+      ReleasePort(port_);
+      portClaimed_ = false;
+   }
+   return ret;
+}
+
+/**
+ * Lock-free: reads the snapshot published by the client and I/O threads.
+ */
+bool AndorAMH::Busy()
+{
+   uint64_t snap = snapshot_.load(std::memory_order_acquire);
+   if (snap & SnapBusy)
+      return true;
+
+   // the ack latency alone says nothing about the light, so until a sensor
+   // calibration exists Delay stays the floor
+   double settleMs = GetDelayMs();
+   if (autoSettle_ && settleHist_.Count() > 0)
+      settleMs = settleCalibrated_ ? SettleMs() : std::max(settleMs, SettleMs());
+   long long elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - snapshotEpoch_).count() - (long long) (snap >> SnapTimeShift);
+   return elapsedUs < settleMs * 1000.0;
+}
+
+int AndorAMH::SetOpen(bool open)
+{
+   long pos;
+   if (open)
+      pos = 1;
+   else
+      pos = 0;
+   int ret = SetProperty(MM::g_Keyword_State, CDeviceUtils::ConvertToString(pos));
+   if (ret != DEVICE_OK)
+      return ret;
+
+   std::lock_guard<std::mutex> guard(ioLock_);
+   return TakeAsyncErrorLocked();
+}
+
+int AndorAMH::GetOpen(bool& open)
+{
+   open = (snapshot_.load(std::memory_order_acquire) & SnapOpen) != 0;
+   return DEVICE_OK;
+}
+
+/**
+ * Opens the light for deltaT ms and closes it again.  The pulse is timed on
+ * the I/O thread, so this returns as soon as it is queued and the caller can
+ * start the camera.  Busy() stays true until the closing ack has arrived.
+ */
+int AndorAMH::Fire(double deltaT)
+{
+   if (deltaT <= 0.0)
+      return DEVICE_INVALID_INPUT_PARAM;
+
+   IOCommand cmd;
+   TakeArmedIntensity();
+   cmd.level = intensity_;
+   cmd.pulseMs = deltaT;
+
+   int earlier;
+   int ret = EnqueueAndReport(cmd, earlier);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // the pulse leaves the light closed
+   curState_ = false;
+   PublishSetting();
+   OnPropertyChanged(MM::g_Keyword_State, "0");
+   return earlier;
+}
+
+/**
+ * Queues the configured pulse train.  Like Fire() this returns at once and
+ * Busy() stays true until the train has ended.  Opening or closing the
+ * light ends the train after the current pulse instead of waiting behind
+ * it.  The train leaves the light closed.
+ */
+int AndorAMH::StartBurst()
+{
+   if (burstWidthMs_ >= burstPeriodMs_)
+      return DEVICE_INVALID_PROPERTY_VALUE;
+
+   IOCommand cmd;
+   cmd.level = burstIntensity_;
+   cmd.pulseMs = burstWidthMs_;
+   cmd.burstCount = burstCount_;
+   cmd.burstPeriodMs = burstPeriodMs_;
+   cmd.stops = burstStops_;
+
+   int earlier;
+   int ret = EnqueueAndReport(cmd, earlier);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   curState_ = false;
+   PublishSetting();
+   OnPropertyChanged(MM::g_Keyword_State, "0");
+   return earlier;
+}
+
+/**
+ * Queues the configured ramp.  Returns at once; Busy() stays true until the
+ * ramp has ended.  Afterwards the light is open at Ramp End, or closed if
+ * that is 0.  Opening or closing the light ends the ramp at the level
+ * reached instead of waiting behind it.
+ */
+int AndorAMH::StartRamp()
+{
+   if (rampStart_ == rampEnd_)
+      return DEVICE_INVALID_PROPERTY_VALUE;
+
+   IOCommand cmd;
+   cmd.level = rampStart_;
+   cmd.rampTo = rampEnd_;
+   cmd.rampMs = rampMs_;
+   cmd.rampExponential = rampExponential_;
+   cmd.stops = rampStops_;
+
+   int earlier;
+   int ret = EnqueueAndReport(cmd, earlier);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   curState_ = rampEnd_ > 0;
+   if (curState_)
+   {
+      intensity_ = rampEnd_;
+      OnPropertyChanged("Intensity", CDeviceUtils::ConvertToString(intensity_));
+   }
+   PublishSetting();
+   OnPropertyChanged(MM::g_Keyword_State, curState_ ? "1" : "0");
+   return earlier;
+}
+
+/**
+ * Queues an open/close command for the I/O thread.  Waits for the answer
+ * unless the device is in asynchronous mode.  Nothing is sent if the light
+ * is already known to be at the requested level, unless force is set.
+ */
+int AndorAMH::SetShutterPosition(bool state, bool force)
+{
+   // a batching hub lets its units switch together
+   bool wait = !async_ && !(hub_ != 0 && hub_->Batching());
+   int result = DEVICE_OK;
+   bool done = false;
+   IOCommand cmd;
+   cmd.level = state ? intensity_ : 0;
+   cmd.result = wait ? &result : 0;
+   cmd.done = wait ? &done : 0;
+
+   std::unique_lock<std::mutex> lock(ioLock_);
+   if (stopIO_ || !ioThread_.joinable())
+      return DEVICE_NOT_CONNECTED;
+   // the client takes the light over from a train or ramp queued or running
+   burstStops_++;
+   rampStops_++;
+   // a held-back close is superseded; if this opens again, the light never
+   // went off and the command below is usually redundant
+   holdPending_ = false;
+   if (!force && IsRedundant(cmd.level))
+      return DEVICE_OK;
+   int ret = EnqueueLocked(lock, cmd);
+   if (ret != DEVICE_OK || !wait)
+      return ret;
+
+   ioDoneCond_.wait(lock, [&done] { return done; });
+   return result;
+}
+
+/**
+ * Holds back a close for holdOpenMs_.  The I/O thread sends it when the
+ * time is up unless another command, typically the next open, comes first.
+ * Returns at once and Busy() stays false: logically the light is closed.
+ */
+int AndorAMH::HoldOpen()
+{
+   std::lock_guard<std::mutex> guard(ioLock_);
+   if (stopIO_ || !ioThread_.joinable())
+      return DEVICE_NOT_CONNECTED;
+   burstStops_++;
+   rampStops_++;
+   if (IsRedundant(0))
+      return DEVICE_OK;
+   // the first close starts the hold, repeated ones cannot stretch it
+   if (!holdPending_)
+   {
+      holdPending_ = true;
+      holdUntil_ = std::chrono::steady_clock::now() +
+         std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(holdOpenMs_));
+      ioCond_.notify_one();
+   }
+   return TakeAsyncErrorLocked();
+}
+
+/**
+ * Queues an intensity change of the open light without waiting for it.  An
+ * update that has not been sent yet is overwritten, so while the slider is
+ * dragged only the latest value goes out once the previous ack is back.
+ */
+int AndorAMH::UpdateIntensity()
+{
+   std::unique_lock<std::mutex> lock(ioLock_);
+   if (stopIO_ || !ioThread_.joinable())
+      return DEVICE_NOT_CONNECTED;
+
+   if (IsRedundant(intensity_))
+   {
+      // nothing to send
+   }
+   else if (!ioQueue_.empty() && ioQueue_.back().coalesce)
+   {
+      ioQueue_.back().level = intensity_;
+   }
+   else
+   {
+      IOCommand cmd;
+      cmd.level = intensity_;
+      cmd.coalesce = true;
+      int ret = EnqueueLocked(lock, cmd);
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+
+   // report a failure of an earlier update
+   return TakeAsyncErrorLocked();
+}
+
+/**
+ * Stages the intensity for the next opening of the light, which then sends
+ * it in its one LIGHT command.  Unlike setting Intensity while the light is
+ * on, this sends nothing now, so the running exposure is not disturbed and
+ * the channel switch costs no round trip of its own.  0 disarms.
+ */
+int AndorAMH::ArmIntensity(long level)
+{
+   if (level < 0 || level > AMH_MAX_LEVEL)
+      return DEVICE_INVALID_INPUT_PARAM;
+   armedIntensity_ = level;
+   return DEVICE_OK;
+}
+
+/**
+ * On opening, makes an armed intensity the current one.
+ */
+void AndorAMH::TakeArmedIntensity()
+{
+   if (armedIntensity_ == 0)
+      return;
+
+   intensity_ = armedIntensity_;
+   armedIntensity_ = 0;
+   PublishSetting();
+   OnPropertyChanged("Intensity", CDeviceUtils::ConvertToString(intensity_));
+   OnPropertyChanged(g_ArmedIntensity, "0");
+}
+
+/**
+ * Parses "name=level" entries, separated by ';' or new lines, into
+ * presets.  Blank entries and lines starting with '#' are skipped.
+ */
+static bool ParsePresets(std::string text, std::map<std::string, long>& presets)
+{
+   std::replace(text.begin(), text.end(), ';', '\n');
+   std::istringstream is(text);
+   std::string item;
+   while (std::getline(is, item))
+   {
+      std::string::size_type first = item.find_first_not_of(" \t\r");
+      if (first == std::string::npos || item[first] == '#')
+         continue;
+      std::string::size_type eq = item.find('=');
+      if (eq == std::string::npos)
+         return false;
+      std::string name = item.substr(first, eq - first);
+      name.erase(name.find_last_not_of(" \t") + 1);
+
+      const char* value = item.c_str() + eq + 1;
+      char* end;
+      long level = strtol(value, &end, 10);
+      if (end == value || strspn(end, " \t\r") != strlen(end))
+         return false;
+      if (name.empty() || name == g_NoPreset || level < 0 || level > AMH_MAX_LEVEL)
+         return false;
+      presets[name] = level;
+   }
+   return true;
+}
+
+/**
+ * Replaces the presets from Presets and Preset File and offers their names
+ * on Preset.
+ */
+int AndorAMH::LoadPresets(const std::string& text, const std::string& file)
+{
+   std::map<std::string, long> presets;
+   if (!ParsePresets(text, presets))
+      return DEVICE_INVALID_PROPERTY_VALUE;
+   if (!file.empty())
+   {
+      std::ifstream in(file.c_str());
+      if (!in)
+         return ERR_PRESET_FILE;
+      std::stringstream contents;
+      contents << in.rdbuf();
+      if (!ParsePresets(contents.str(), presets))
+         return ERR_PRESET_FILE;
+   }
+
+   std::vector<std::string> names(1, g_NoPreset);
+   for (std::map<std::string, long>::const_iterator it = presets.begin(); it != presets.end(); ++it)
+      names.push_back(it->first);
+   int ret = SetAllowedValues(g_Preset, names);
+   if (ret != DEVICE_OK)
+      return ret;
+   presets_.swap(presets);
+   if (presets_.count(preset_) == 0)
+      preset_ = g_NoPreset;
+   return DEVICE_OK;
+}
+
+/**
+ * Switches to a preset in one LIGHT command, its level from the
+ * pre-built table.  State and Intensity follow without sending anything
+ * of their own, so there is no intermediate state.  Off leaves Intensity
+ * as it was.
+ */
+int AndorAMH::ApplyPreset(const std::string& name)
+{
+   std::map<std::string, long>::const_iterator it = presets_.find(name);
+   if (it == presets_.end())
+      return DEVICE_INVALID_PROPERTY_VALUE;
+
+   long level = it->second;
+   preset_ = name;
+   armedIntensity_ = 0;
+   curState_ = level > 0;
+   if (curState_)
+      intensity_ = level;
+   PublishSetting();
+   OnPropertyChanged(MM::g_Keyword_State, curState_ ? "1" : "0");
+   OnPropertyChanged("Intensity", CDeviceUtils::ConvertToString(intensity_));
+   return SetShutterPosition(curState_);
+}
+
+/**
+ * True when the I/O thread is idle and the device has acknowledged this
+ * level last.  Call with ioLock_ held.
+ */
+bool AndorAMH::IsRedundant(long level) const
+{
+   return ioQueue_.empty() && !ioInFlight_ && level == lastLevel_;
+}
+
+/**
+ * Puts cmd on the I/O queue, waiting for room if the queue is full.  Call
+ * with lock holding ioLock_.
+ */
+int AndorAMH::EnqueueLocked(std::unique_lock<std::mutex>& lock, const IOCommand& cmd)
+{
+   ioDoneCond_.wait(lock, [this] { return stopIO_ || !ioQueue_.full(); });
+   if (stopIO_ || !ioThread_.joinable())
+      return DEVICE_NOT_CONNECTED;
+   holdPending_ = false;
+   ioQueue_.push_back(cmd);
+   ioQueue_.back().queued = std::chrono::steady_clock::now();
+   PublishBusyLocked();
+   ioCond_.notify_one();
+   return DEVICE_OK;
+}
+
+/**
+ * Queues cmd without waiting for it.  Returns the enqueue failure, if any,
+ * and leaves a failure of an earlier asynchronous command in earlier.
+ */
+int AndorAMH::EnqueueAndReport(const IOCommand& cmd, int& earlier)
+{
+   std::unique_lock<std::mutex> lock(ioLock_);
+   earlier = DEVICE_OK;
+   int ret = EnqueueLocked(lock, cmd);
+   if (ret != DEVICE_OK)
+      return ret;
+   earlier = TakeAsyncErrorLocked();
+   return DEVICE_OK;
+}
+
+/**
+ * Returns and clears the failure of an earlier asynchronous command, so it
+ * is reported to the next client call.  Call with ioLock_ held.
+ */
+int AndorAMH::TakeAsyncErrorLocked()
+{
+   int ret = asyncError_;
+   asyncError_ = DEVICE_OK;
+   return ret;
+}
+
+/**
+ * Sends a LIGHT command through the serial port and waits for its answer.
+ * Only called on the I/O thread, with nothing else in flight.
+ */
+int AndorAMH::SendLightCommand(long level)
+{
+   int ret = WriteLightCommand(level);
+   if (ret != DEVICE_OK)
+      return ret;
+   return ReadLightAck(level);
+}
+
+/**
+ * Writes the pre-built LIGHT command without waiting for the answer.  Only
+ * called on the I/O thread.
+ */
+int AndorAMH::WriteLightCommand(long level)
+{
+   // the light state is unknown until this command is acknowledged
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      lastLevel_ = -1;
+   }
+
+   if (!light_.InRange(level))
+      return DEVICE_INVALID_INPUT_PARAM;
+
+   trace_.Record(CommandTrace::Send, level);
+   return transport_->Write(light_.Text(level), light_.Length(level));
+}
+
+/**
+ * Waits for the answer to the oldest LIGHT command in flight and maps an
+ * E,nn reply to ERR_OFFSET + nn.  Without publish the settle delay is not
+ * restarted, for commands that do not change the light.  Only called on
+ * the I/O thread.
+ */
+int AndorAMH::ReadLightAck(long level, bool publish)
+{
+   // block/wait for acknowledge, or until we time out; replies belonging to
+   // earlier commands that timed out are skipped
+   char answer[AMH_ANSWER_SIZE];
+   for (;;)
+   {
+      int ret = ReadReply(answer, AMH_ANSWER_SIZE);
+      if (ret == DEVICE_SERIAL_TIMEOUT)
+      {
+         staleReplies_++;
+         timeouts_++;
+         trace_.Record(CommandTrace::Timeout, level);
+         linkState_ = LinkLost;
+      }
+      if (ret != DEVICE_OK)
+         return ret;
+      linkState_ = LinkUp;
+      if (staleReplies_ == 0)
+         break;
+      staleReplies_--;
+   }
+
+   // Set timer for Busy signal
+   std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+   if (publish)
+      PublishChange(now);
+   AMHProtocol::Light::Reply reply = AMHProtocol::Light::Reply::Parse(answer);
+   if (reply.kind == reply.Ack)
+   {
+      {
+         std::lock_guard<std::mutex> guard(ioLock_);
+         lastLevel_ = level;
+         AccrueDoseLocked(now);
+         doseLevel_ = level;
+      }
+      trace_.Record(CommandTrace::Ack, level);
+      return DEVICE_OK;
+   }
+   else if (reply.kind == reply.Error)
+   {
+      char messg[64];
+      snprintf(messg, sizeof(messg), "Error in received answer, giving code: %d", reply.code);
+      LogMessage(messg, true);
+      trace_.Record(CommandTrace::Error, level, reply.code);
+      if (flushTraceOnError_)
+      {
+         std::lock_guard<std::mutex> guard(ioLock_);
+         traceFlushPending_ = true;
+         traceCond_.notify_one();
+      }
+      return reply.ToDeviceError(ERR_OFFSET);
+   }
+
+   // unrecognised answer: the framing can no longer be trusted, and the
+   // command may not have been carried out
+   LogMessage("Unrecognised answer received, resynchronising the port", true);
+   trace_.Record(CommandTrace::Unrecognised, level);
+   int ret = ResyncPort();
+   return ret != DEVICE_OK ? ret : ERR_UNRECOGNIZED_ANSWER;
+}
+
+/**
+ * Returns the next reply from the receive buffer, reading from the port
+ * until one is complete or the answer timeout expires.  Line feeds and empty
+ * lines are ignored.  Only called on the I/O thread.
+ */
+int AndorAMH::ReadReply(char* reply, unsigned size)
+{
+   std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(answerTimeoutMs_.load());
+   for (;;)
+   {
+      // take complete replies off the front of the buffer
+      char* end = (char*) memchr(rxBuf_, '\r', rxLen_);
+      while (end != 0)
+      {
+         unsigned frameLen = (unsigned) (end - rxBuf_);
+         unsigned n = 0;
+         for (unsigned i = 0; i < frameLen; i++)
+         {
+            if (rxBuf_[i] != '\n' && n + 1 < size)
+               reply[n++] = rxBuf_[i];
+         }
+         reply[n] = 0;
+         rxLen_ -= frameLen + 1;
+         memmove(rxBuf_, end + 1, rxLen_);
+         if (n > 0)
+            return DEVICE_OK;
+         end = (char*) memchr(rxBuf_, '\r', rxLen_);
+      }
+
+      if (rxLen_ == AMH_RX_SIZE)
+      {
+         LogMessage("Receive buffer overrun, resynchronising the port", false);
+         ResyncPort();
+         return DEVICE_SERIAL_INVALID_RESPONSE;
+      }
+
+      unsigned long read = 0;
+      int ret = transport_->Read(rxBuf_ + rxLen_, AMH_RX_SIZE - rxLen_, read);
+      if (ret != DEVICE_OK)
+         return ret;
+      rxLen_ += (unsigned) read;
+      if (read > 0)
+         continue;
+
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if (now > deadline)
+         return DEVICE_SERIAL_TIMEOUT;
+      transport_->WaitReadable((long) std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count() + 1);
+   }
+}
+
+/**
+ * With nothing in flight, whatever has been received belongs to commands
+ * that timed out; it is thrown away, and replies still owed after that are
+ * taken as lost.  Without this a dropped reply would make every later
+ * command skip its own answer as the missing one and time out in turn,
+ * and a reply later than that would leave the answers off by one.  Only
+ * called on the I/O thread.
+ */
+void AndorAMH::DropLeftovers()
+{
+   unsigned long read = 0;
+   while (transport_->Read(rxBuf_, AMH_RX_SIZE, read) == DEVICE_OK && read > 0)
+      ;
+   rxLen_ = 0;
+   staleReplies_ = 0;
+}
+
+/**
+ * Throws away everything received so far.  Done when the I/O thread starts
+ * and after a reply could not be parsed.  Only called on the I/O thread.
+ */
+int AndorAMH::ResyncPort()
+{
+   trace_.Record(CommandTrace::Resync, 0);
+   rxLen_ = 0;
+   staleReplies_ = 0;
+   resynced_ = true;
+   return transport_->Purge();
+}
+
+/**
+ * SendLightCommand, also recording when the command went out and folding its
+ * round trip into roundTripMs_.  Only called on the I/O thread.
+ */
+int AndorAMH::TimedLightCommand(long level, std::chrono::steady_clock::time_point& sent)
+{
+   sent = std::chrono::steady_clock::now();
+   int ret = SendLightCommand(level);
+   if (ret == DEVICE_OK)
+   {
+      double rtt = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent).count();
+      roundTripMs_ = roundTripMs_ > 0.0 ? 0.9 * roundTripMs_ + 0.1 * rtt : rtt;
+   }
+   return ret;
+}
+
+/**
+ * Folds the round trip of an acknowledged command into roundTripMs_.  Only
+ * commands that had the link to themselves give a meaningful latency.
+ */
+void AndorAMH::UpdateRoundTrip(const IOCommand& cmd)
+{
+   if (!cmd.solo)
+      return;
+   double rtt = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - cmd.sent).count();
+   roundTripMs_ = roundTripMs_ > 0.0 ? 0.9 * roundTripMs_ + 0.1 * rtt : rtt;
+}
+
+/**
+ * Opens the light and closes it pulseMs later.  The device switches roughly
+ * half a round trip after a command is sent, so the close goes out at
+ * open + pulseMs, corrected by the difference between the measured latency
+ * of the open and the expected latency of the close.  The close is timed by
+ * sleeping until shortly before it is due and spinning for the remainder.
+ */
+int AndorAMH::SendPulse(long level, double pulseMs)
+{
+   typedef std::chrono::steady_clock clock;
+   typedef std::chrono::duration<double, std::milli> ms;
+
+   clock::time_point openSent;
+   int ret = TimedLightCommand(level, openSent);
+   if (ret != DEVICE_OK)
+      return ret;
+   double openLatency = ms(clock::now() - openSent).count() / 2.0;
+   double closeLatency = roundTripMs_ / 2.0;
+
+   WaitUntil(openSent + std::chrono::duration_cast<clock::duration>(ms(pulseMs + openLatency - closeLatency)));
+
+   clock::time_point closeSent;
+   ret = TimedLightCommand(0, closeSent);
+   double onTime = ms(closeSent - openSent).count() +
+      ms(clock::now() - closeSent).count() / 2.0 - openLatency;
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      fireOnTimeMs_ = onTime;
+      SetSettleFromLocked(closeSent);
+   }
+   std::ostringstream os;
+   os << "Fire: requested " << pulseMs << " ms, achieved " << onTime << " ms";
+   LogMessage(os.str(), true);
+   return ret;
+}
+
+/**
+ * Runs a train of cmd.burstCount pulses of cmd.pulseMs, one every
+ * cmd.burstPeriodMs, from the pre-built LIGHT commands.  As in SendPulse()
+ * every command goes out half a round trip before the light is due to
+ * switch, using the running round-trip estimate, and the achieved on-times
+ * and periods are estimated from the measured round trips.  Stop Burst, or
+ * a client switching the light, ends the train after the current pulse.
+ * Only called on the I/O thread.
+ */
+int AndorAMH::SendBurst(const IOCommand& cmd)
+{
+   typedef std::chrono::steady_clock clock;
+   typedef std::chrono::duration<double, std::milli> ms;
+
+   clock::time_point start = clock::now() +
+      std::chrono::duration_cast<clock::duration>(ms(roundTripMs_ / 2.0));
+   double onSum = 0.0, onMin = 0.0, onMax = 0.0;
+   double periodMin = 0.0, periodMax = 0.0;
+   double firstOpen = 0.0, lastOpen = 0.0;
+   clock::time_point closeSent = clock::now();
+   long pulses = 0;
+   int ret = DEVICE_OK;
+   while (pulses < cmd.burstCount)
+   {
+      double due = pulses * cmd.burstPeriodMs;
+      if (!WaitUnlessStopped(start + std::chrono::duration_cast<clock::duration>(ms(due - roundTripMs_ / 2.0)),
+            burstStops_, cmd.stops))
+         break;
+      clock::time_point openSent;
+      ret = TimedLightCommand(cmd.level, openSent);
+      if (ret != DEVICE_OK)
+         break;
+      double open = ms(openSent - start).count() + ms(clock::now() - openSent).count() / 2.0;
+
+      WaitUntil(start + std::chrono::duration_cast<clock::duration>(ms(due + cmd.pulseMs - roundTripMs_ / 2.0)));
+      ret = TimedLightCommand(0, closeSent);
+      if (ret != DEVICE_OK)
+         break;
+      double onTime = ms(closeSent - start).count() + ms(clock::now() - closeSent).count() / 2.0 - open;
+
+      onSum += onTime;
+      onMin = pulses == 0 || onTime < onMin ? onTime : onMin;
+      onMax = pulses == 0 || onTime > onMax ? onTime : onMax;
+      if (pulses == 0)
+         firstOpen = open;
+      else
+      {
+         double period = open - lastOpen;
+         periodMin = pulses == 1 || period < periodMin ? period : periodMin;
+         periodMax = pulses == 1 || period > periodMax ? period : periodMax;
+      }
+      lastOpen = open;
+      pulses++;
+   }
+   if (ret != DEVICE_OK)
+      SendLightCommand(0);   // do not leave the light on after a failure
+
+   char result[MM::MaxStrLength];
+   snprintf(result, sizeof(result),
+      "%ld of %ld pulses; on-time mean %.3f ms, min %.3f ms, max %.3f ms; period mean %.3f ms, min %.3f ms, max %.3f ms",
+      pulses, cmd.burstCount, pulses > 0 ? onSum / pulses : 0.0, onMin, onMax,
+      pulses > 1 ? (lastOpen - firstOpen) / (pulses - 1) : 0.0, periodMin, periodMax);
+   LogMessage(std::string("Burst: ") + result, true);
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      burstResult_ = result;
+      SetSettleFromLocked(closeSent);
+   }
+   return ret;
+}
+
+/**
+ * Steps the light from cmd.level to cmd.rampTo over cmd.rampMs, linearly
+ * or exponentially in (level + 1) so a ramp from 0 works.  Each step waits
+ * for its ack before the next goes out, so the ramp runs at whatever rate
+ * the link sustains; levels that fall due while a step is in flight are
+ * skipped, and between steps the thread sleeps until the next level is
+ * due.  Stop Ramp, or a client switching the light, leaves the light at
+ * the level reached.  Only called on the I/O thread.
+ */
+int AndorAMH::SendRamp(const IOCommand& cmd)
+{
+   typedef std::chrono::steady_clock clock;
+   typedef std::chrono::duration<double, std::milli> ms;
+
+   const double from = (double) cmd.level;
+   const double to = (double) cmd.rampTo;
+   const long dir = cmd.rampTo > cmd.level ? 1 : -1;
+   const double ratio = (to + 1.0) / (from + 1.0);
+
+   clock::time_point start = clock::now();
+   long level = cmd.level;
+   long steps = 1;
+   int ret = SendLightCommand(level);
+   while (ret == DEVICE_OK && level != cmd.rampTo && rampStops_ == cmd.stops)
+   {
+      double f = ms(clock::now() - start).count() / cmd.rampMs;
+      long due = cmd.rampTo;
+      if (f < 1.0)
+         due = (long) floor((cmd.rampExponential ? (from + 1.0) * pow(ratio, f) - 1.0 : from + (to - from) * f) + 0.5);
+      if (due == level)
+      {
+         // sleep until the value rounds to the next level
+         double v = level + dir * 0.5;
+         double next = cmd.rampExponential ? log((v + 1.0) / (from + 1.0)) / log(ratio) : (v - from) / (to - from);
+         clock::time_point wake = start + std::chrono::duration_cast<clock::duration>(ms(next * cmd.rampMs));
+         std::this_thread::sleep_until(std::min(wake, clock::now() + std::chrono::milliseconds(10)));
+         continue;
+      }
+      level = due;
+      ret = SendLightCommand(level);
+      steps++;
+   }
+   double elapsed = ms(clock::now() - start).count();
+
+   char result[MM::MaxStrLength];
+   snprintf(result, sizeof(result), "%ld to %ld: %ld steps in %.1f ms (requested %.1f ms), mean step %.3f ms",
+      cmd.level, level, steps, elapsed, cmd.rampMs, steps > 1 ? elapsed / (steps - 1) : 0.0);
+   LogMessage(std::string("Ramp: ") + result, true);
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      rampResult_ = result;
+   }
+   return ret;
+}
+
+/**
+ * Returns at t.  The scheduler alone would be up to a millisecond late; the
+ * last stretch is timed by the process-wide timer thread, so devices do
+ * not each spin for their edges.  Only called on the I/O thread.
+ */
+void AndorAMH::WaitUntil(std::chrono::steady_clock::time_point t)
+{
+   timer_->WaitUntil(t);
+}
+
+/**
+ * WaitUntil(t), giving up as soon as stops no longer equals queuedUnder.
+ * Returns false if it gave up.  Only called on the I/O thread.
+ */
+bool AndorAMH::WaitUnlessStopped(std::chrono::steady_clock::time_point t, const std::atomic<unsigned>& stops, unsigned queuedUnder)
+{
+   // sleep in short slices, the timer takes the last stretch
+   const std::chrono::milliseconds slice(5);
+   while (stops == queuedUnder && std::chrono::steady_clock::now() + 2 * slice < t)
+      std::this_thread::sleep_for(slice);
+   if (stops != queuedUnder)
+      return false;
+   WaitUntil(t);
+   return true;
+}
+
+/**
+ * Serial I/O worker.  Sends queued commands in order, up to pipelineDepth_
+ * of them back to back, and matches the answers to them in FIFO order.  A
+ * command stays in flight (and Busy() true) until its answer has arrived.
+ * A Fire pulse waits until everything before it is acknowledged and then
+ * has the link to itself.
+ */
+void AndorAMH::IOWorker()
+{
+   ResyncPort();
+
+   BoundedQueue<IOCommand, AMH_MAX_PIPELINE> inFlight;
+   std::unique_lock<std::mutex> lock(ioLock_);
+   for (;;)
+   {
+      if (inFlight.empty())
+      {
+         ioInFlight_ = false;
+         PublishBusyLocked();
+         std::chrono::steady_clock::time_point idleSince = std::chrono::steady_clock::now();
+         long quiet = AMH_HEALTH_QUIET;   // intervals until the next check
+         while (!stopIO_ && ioQueue_.empty())
+         {
+            // no health checks while a sequence runs or the level is unknown
+            bool check = healthIntervalMs_ > 0 && !sequenceRunning_ &&
+               (lastLevel_ >= 0 || checkLevel_ >= 0);
+            std::chrono::steady_clock::time_point due = idleSince + std::chrono::milliseconds(quiet * healthIntervalMs_);
+            if (!holdPending_ && check && std::chrono::steady_clock::now() >= due && Busy())
+            {
+               // the light is still settling after the last command
+               ioCond_.wait_for(lock, std::chrono::milliseconds(1));
+            }
+            else if (!holdPending_ && check && std::chrono::steady_clock::now() >= due)
+            {
+               CheckLink(lock);
+               idleSince = std::chrono::steady_clock::now();
+               quiet = 1;
+            }
+            else if (!holdPending_ && check)
+            {
+               ioCond_.wait_until(lock, due);
+            }
+            else if (!holdPending_)
+            {
+               ioCond_.wait(lock);
+            }
+            else if (std::chrono::steady_clock::now() < holdUntil_)
+            {
+               ioCond_.wait_until(lock, holdUntil_);
+            }
+            else
+            {
+               // the light was not reopened in time
+               IOCommand close;
+               close.level = 0;
+               close.result = 0;
+               close.done = 0;
+               close.coalesce = false;
+               close.pulseMs = 0.0;
+               close.queued = std::chrono::steady_clock::now();
+               ioQueue_.push_back(close);
+               holdPending_ = false;
+               PublishBusyLocked();
+            }
+         }
+         if (ioQueue_.empty())
+            return;
+      }
+
+      // issue as many commands as the pipeline allows
+      while (!ioQueue_.empty() && (long) inFlight.size() < pipelineDepth_ &&
+            !(ioQueue_.front().Exclusive() && !inFlight.empty()))
+      {
+         IOCommand cmd = ioQueue_.front();
+         ioQueue_.pop_front();
+         ioDoneCond_.notify_all();  // room on the queue
+         checkLevel_ = -1;
+         ioInFlight_ = true;
+         lock.unlock();
+
+         int ret;
+         if (cmd.rampMs > 0.0)
+         {
+            ret = SendRamp(cmd);
+         }
+         else if (cmd.burstCount > 0)
+         {
+            ret = SendBurst(cmd);
+         }
+         else if (cmd.pulseMs > 0.0)
+         {
+            ret = SendPulse(cmd.level, cmd.pulseMs);
+         }
+         else
+         {
+            cmd.solo = inFlight.empty();
+            if (cmd.solo && (staleReplies_ > 0 || rxLen_ > 0))
+               DropLeftovers();
+            cmd.sent = std::chrono::steady_clock::now();
+            ret = WriteLightCommand(cmd.level);
+            cmd.written = std::chrono::steady_clock::now();
+            if (ret == DEVICE_OK)
+               inFlight.push_back(cmd);
+         }
+
+         lock.lock();
+         if (cmd.Exclusive() || ret != DEVICE_OK)
+            CompleteCommand(cmd, ret);
+      }
+      if (inFlight.empty())
+         continue;
+
+      // wait for the oldest answer
+      IOCommand cmd = inFlight.front();
+      inFlight.pop_front();
+      lock.unlock();
+      resynced_ = false;
+      int ret = ReadLightAck(cmd.level);
+      if (ret == DEVICE_SERIAL_TIMEOUT && retry_)
+         ret = RetryAfterTimeout(cmd, inFlight);
+      if (ret == DEVICE_OK)
+      {
+         UpdateRoundTrip(cmd);
+         RecordLatency(cmd);
+      }
+      int lostRet = DEVICE_OK;
+      if (ret == DEVICE_SERIAL_TIMEOUT)
+      {
+         // the answers of the later commands are not going to make it either
+         staleReplies_ += (unsigned) inFlight.size();
+         lostRet = DEVICE_SERIAL_TIMEOUT;
+      }
+      else if (resynced_)
+      {
+         lostRet = DEVICE_SERIAL_INVALID_RESPONSE;
+      }
+      lock.lock();
+
+      if (ret == DEVICE_OK)
+         SetSettleFromLocked(cmd.sent);
+      CompleteCommand(cmd, ret);
+      if (lostRet != DEVICE_OK)
+      {
+         while (!inFlight.empty())
+         {
+            CompleteCommand(inFlight.front(), lostRet);
+            inFlight.pop_front();
+         }
+      }
+   }
+}
+
+/**
+ * Second and last attempt at a command whose ack timed out: resynchronises
+ * the port, which drops whatever answers of the later commands in flight
+ * had arrived, writes the command and those later ones again (LIGHT,n is
+ * idempotent, so repeating one is harmless) and waits for the first ack
+ * once more.  Pulses, trains and ramps are not retried, as a late repeat
+ * would spoil their timing.  Only called on the I/O thread.
+ */
+int AndorAMH::RetryAfterTimeout(IOCommand& cmd, BoundedQueue<IOCommand, AMH_MAX_PIPELINE>& inFlight)
+{
+   LogMessage("Answer timeout, resending the command", true);
+   retries_++;
+   trace_.Record(CommandTrace::Retry, cmd.level);
+   int ret = ResyncPort();
+   if (ret != DEVICE_OK)
+      return ret;
+
+   cmd.sent = std::chrono::steady_clock::now();
+   ret = WriteLightCommand(cmd.level);
+   cmd.written = std::chrono::steady_clock::now();
+   for (size_t i = 0; i < inFlight.size() && ret == DEVICE_OK; i++)
+   {
+      inFlight[i].sent = std::chrono::steady_clock::now();
+      ret = WriteLightCommand(inFlight[i].level);
+      inFlight[i].written = std::chrono::steady_clock::now();
+   }
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // the commands in flight have been sent again, their answers are due
+   resynced_ = false;
+   return ReadLightAck(cmd.level);
+}
+
+/**
+ * Health check: resends the acknowledged level, which leaves the light as
+ * it is, and notes whether and how fast the unit answered.  Busy() and the
+ * settle delay are not touched; a client command arriving meanwhile waits
+ * on the queue for at most this one round trip.  Only called on the I/O
+ * thread, with lock holding ioLock_ and nothing queued or in flight.
+ */
+void AndorAMH::CheckLink(std::unique_lock<std::mutex>& lock)
+{
+   // a check that went unanswered left lastLevel_ unknown; the next one
+   // sends the same level, so a link that comes back is seen
+   long level = lastLevel_ >= 0 ? lastLevel_ : checkLevel_;
+   checkLevel_ = level;
+   lock.unlock();
+
+   if (staleReplies_ > 0 || rxLen_ > 0)
+      DropLeftovers();
+   std::chrono::steady_clock::time_point sent = std::chrono::steady_clock::now();
+   int ret = WriteLightCommand(level);
+   if (ret != DEVICE_OK)
+      linkState_ = LinkLost;   // the port itself failed
+   else
+      ret = ReadLightAck(level, false);
+   if (ret == DEVICE_OK)
+      linkLatencyUs_ = (long) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sent).count();
+   else if (linkState_ == LinkLost)
+      LogMessage("Health check: the unit does not answer", false);
+
+   lock.lock();
+}
+
+/**
+ * Records the send, ack wait and total (queued to acknowledged) latency of a
+ * command whose answer has just arrived and, without a sensor calibration,
+ * its send-to-ack time as a settle sample.  Lock-free.
+ */
+void AndorAMH::RecordLatency(const IOCommand& cmd)
+{
+   typedef std::chrono::microseconds us;
+   std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+   linkLatencyUs_ = (long) std::chrono::duration_cast<us>(now - cmd.sent).count();
+   latency_[SendStage].Record((uint32_t) std::chrono::duration_cast<us>(cmd.written - cmd.sent).count());
+   latency_[AckWaitStage].Record((uint32_t) std::chrono::duration_cast<us>(now - cmd.written).count());
+   latency_[TotalStage].Record((uint32_t) std::chrono::duration_cast<us>(now - cmd.queued).count());
+   if (!settleCalibrated_)
+      settleHist_.Record((uint32_t) std::chrono::duration_cast<us>(now - cmd.sent).count());
+}
+
+/**
+ * Auto settle time: the configured percentile of the measured time from
+ * sending a command to stable light, or to its ack before a calibration.
+ */
+double AndorAMH::SettleMs() const
+{
+   return settleHist_.Percentile(settlePercentile_ / 100.0) / 1000.0;
+}
+
+/**
+ * Hands the result to a waiting caller, or keeps it for the next client call
+ * in asynchronous mode.  Call with ioLock_ held.
+ */
+void AndorAMH::CompleteCommand(const IOCommand& cmd, int ret)
+{
+   if (cmd.done != 0)
+   {
+      *cmd.result = ret;
+      *cmd.done = true;
+      ioDoneCond_.notify_all();
+   }
+   else if (ret != DEVICE_OK)
+   {
+      LogMessage("Asynchronous shutter command failed", false);
+      asyncError_ = ret;
+   }
+}
+
+/**
+ * Replaces the snapshot fields in mask by bits, leaving the fields other
+ * threads own alone.  Lock-free.
+ */
+void AndorAMH::Publish(uint64_t mask, uint64_t bits)
+{
+   uint64_t cur = snapshot_.load(std::memory_order_relaxed);
+   while (!snapshot_.compare_exchange_weak(cur, (cur & ~mask) | bits,
+         std::memory_order_release, std::memory_order_relaxed))
+      ;
+}
+
+/**
+ * Publishes curState_ and intensity_ after a client thread changed them.
+ */
+void AndorAMH::PublishSetting()
+{
+   Publish(SnapOpen | ((uint64_t) 0xff << SnapIntensityShift),
+      (curState_ ? SnapOpen : 0) | ((uint64_t) (intensity_ & 0xff) << SnapIntensityShift));
+}
+
+/**
+ * Publishes whether commands are queued or in flight.  Call with ioLock_
+ * held.
+ */
+void AndorAMH::PublishBusyLocked()
+{
+   Publish(SnapBusy, !ioQueue_.empty() || ioInFlight_ ? SnapBusy : 0);
+}
+
+/**
+ * Publishes the time the settle delay runs from.
+ */
+void AndorAMH::PublishChange(std::chrono::steady_clock::time_point t)
+{
+   uint64_t us = (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(t - snapshotEpoch_).count();
+   Publish(~(uint64_t) 0 << SnapTimeShift, us << SnapTimeShift);
+}
+
+/**
+ * Notes when the last acknowledged command went out.  With a sensor
+ * calibration Busy() counts from there rather than from the ack.  Call
+ * with ioLock_ held.
+ */
+void AndorAMH::SetSettleFromLocked(std::chrono::steady_clock::time_point sent)
+{
+   settleFrom_ = sent;
+   if (autoSettle_ && settleCalibrated_ && settleHist_.Count() > 0)
+      PublishChange(sent);
+}
+
+/**
+ * Lets the worker finish the commands already queued and joins it.
+ */
+void AndorAMH::StopIOWorker()
+{
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      stopIO_ = true;
+      burstStops_++;
+      rampStops_++;
+      ioCond_.notify_one();
+      ioDoneCond_.notify_all();
+      traceCond_.notify_one();
+   }
+   if (ioThread_.joinable())
+      ioThread_.join();
+   if (traceThread_.joinable())
+      traceThread_.join();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+int AndorAMH::OnState(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      // Fire() closes the light behind the property's back
+      pProp->Set(curState_ ? 1L : 0L);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long pos;
+      pProp->Get(pos);
+      curState_ = pos == 0 ? false : true;
+      PublishSetting();
+      if (curState_)
+         TakeArmedIntensity();
+      else if (holdOpenMs_ > 0.0)
+         return HoldOpen();
+
+      // apply the value
+      return SetShutterPosition(curState_);
+   }
+   // In External trigger mode the camera's fire output gates the light, so
+   // the core can stream frames with the shutter armed once for the whole
+   // sequence instead of toggling it over serial on every frame
+   else if (eAct == MM::IsSequenceable)
+   {
+      pProp->SetSequenceable(externalTrigger_ ? g_MaxGatedSequence : 0);
+   }
+   else if (eAct == MM::AfterLoadSequence)
+   {
+      std::vector<std::string> sequence = pProp->GetSequence();
+      for (size_t i = 0; i < sequence.size(); i++)
+      {
+         if (atol(sequence[i].c_str()) == 0)
+            return ERR_GATED_SEQUENCE;
+      }
+   }
+   else if (eAct == MM::StartSequence)
+   {
+      if (!externalTrigger_)
+         return DEVICE_NOT_SUPPORTED;
+      sequenceRunning_ = true;
+      curState_ = true;
+      PublishSetting();
+      return SetShutterPosition(true);
+   }
+   else if (eAct == MM::StopSequence)
+   {
+      if (!sequenceRunning_)
+         return DEVICE_OK;
+      sequenceRunning_ = false;
+      curState_ = false;
+      PublishSetting();
+      return SetShutterPosition(false);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnPort(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(port_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      if (initialized_)
+      {
+         // revert
+         pProp->Set(port_.c_str());
+         return ERR_PORT_CHANGE_FORBIDDEN;
+      }
+
+      pProp->Get(port_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnDelay(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(this->GetDelayMs());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double delay;
+      pProp->Get(delay);
+      this->SetDelayMs(delay);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnIntensity(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(intensity_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(intensity_);
+      PublishSetting();
+      if (curState_)
+         return UpdateIntensity();
+   }
+   // The firmware has no sequence memory and the adapter sees no frame
+   // triggers: in a hardware-sequenced acquisition the light is opened once,
+   // or gated by the camera, so nothing could step the level per frame.
+   // Not sequenceable, the core sets Intensity between frames instead
+   else if (eAct == MM::IsSequenceable)
+   {
+      pProp->SetSequenceable(0);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnArmedIntensity(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(armedIntensity_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long level;
+      pProp->Get(level);
+      return ArmIntensity(level);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnPresets(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(presetText_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string text;
+      pProp->Get(text);
+      int ret = LoadPresets(text, presetFile_);
+      if (ret != DEVICE_OK)
+      {
+         pProp->Set(presetText_.c_str());
+         return ret;
+      }
+      presetText_ = text;
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnPresetFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(presetFile_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string file;
+      pProp->Get(file);
+      int ret = LoadPresets(presetText_, file);
+      if (ret != DEVICE_OK)
+      {
+         pProp->Set(presetFile_.c_str());
+         return ret;
+      }
+      presetFile_ = file;
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnPreset(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      // a State or Intensity change since leaves no preset applied
+      std::map<std::string, long>::const_iterator it = presets_.find(preset_);
+      if (it == presets_.end() || it->second != (curState_ ? intensity_ : 0))
+         preset_ = g_NoPreset;
+      pProp->Set(preset_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string name;
+      pProp->Get(name);
+      if (name == g_NoPreset)
+      {
+         preset_ = g_NoPreset;
+         return DEVICE_OK;
+      }
+      return ApplyPreset(name);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnAsync(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(async_ ? g_Yes : g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string val;
+      pProp->Get(val);
+      async_ = (val == g_Yes);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnForceResend(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string val;
+      pProp->Get(val);
+      pProp->Set(g_No);
+      if (val == g_Yes)
+         return SetShutterPosition(curState_, true);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnHoldOpen(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(holdOpenMs_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(holdOpenMs_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnHealthInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   std::lock_guard<std::mutex> guard(ioLock_);
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(healthIntervalMs_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(healthIntervalMs_);
+      ioCond_.notify_one();   // the worker's wait runs to the old deadline
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnLinkState(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      int state = linkState_;
+      pProp->Set(state == LinkUp ? g_LinkUp : state == LinkLost ? g_LinkLost : g_LinkUnknown);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnLinkLatency(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(linkLatencyUs_ / 1000.0);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnFireOnTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      pProp->Set(fireOnTimeMs_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnTriggerMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(externalTrigger_ ? g_External : g_Internal);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      if (sequenceRunning_ && mode != g_External)
+      {
+         // revert
+         pProp->Set(g_External);
+         return DEVICE_CAN_NOT_SET_PROPERTY;
+      }
+      externalTrigger_ = (mode == g_External);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnPipelineDepth(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   std::lock_guard<std::mutex> guard(ioLock_);
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(pipelineDepth_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(pipelineDepth_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnLatencyStat(MM::PropertyBase* pProp, MM::ActionType eAct, long data)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      const LatencyHistogram& hist = latency_[data / 8];
+      switch (data % 8)
+      {
+         case 0: pProp->Set((long) hist.Count()); break;
+         case 1: pProp->Set(hist.Min() / 1000.0); break;
+         case 2: pProp->Set(hist.Percentile(0.50) / 1000.0); break;
+         case 3: pProp->Set(hist.Percentile(0.99) / 1000.0); break;
+         case 4: pProp->Set(hist.Max() / 1000.0); break;
+      }
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnAnswerTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(answerTimeoutMs_.load());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long ms;
+      pProp->Get(ms);
+      answerTimeoutMs_ = ms;
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnRetry(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(retry_ ? g_Yes : g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string retry;
+      pProp->Get(retry);
+      retry_ = (retry == g_Yes);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnAnswerStat(MM::PropertyBase* pProp, MM::ActionType eAct, long data)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(data == 0 ? timeouts_.load() : retries_.load());
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnResetStats(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string val;
+      pProp->Get(val);
+      pProp->Set(g_No);
+      if (val == g_Yes)
+      {
+         for (int stage = 0; stage < NumStages; stage++)
+            latency_[stage].Reset();
+         timeouts_ = 0;
+         retries_ = 0;
+      }
+   }
+
+   return DEVICE_OK;
+}
+
+/**
+ * Adds the dose since the last transition at doseLevel_, up to now.  The
+ * transitions are timed by their acks, so the return latency, the same
+ * for the open and the close, cancels out of every on-time.  Call with
+ * ioLock_ held.
+ */
+void AndorAMH::AccrueDoseLocked(std::chrono::steady_clock::time_point now)
+{
+   if (doseLevel_ > 0)
+   {
+      double seconds = std::chrono::duration<double>(now - doseSince_).count();
+      dose_ += doseLevel_ * seconds;
+      onTime_ += seconds;
+      *tagDose_ += doseLevel_ * seconds;
+   }
+   doseSince_ = now;
+}
+
+/**
+ * Writes the command trace to the Trace File.  Called from a property
+ * handler, or on traceThread_ after an E,nn answer.
+ */
+int AndorAMH::FlushTrace()
+{
+   std::string path;
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      path = traceFile_;
+   }
+   if (!trace_.Write(path.c_str()))
+   {
+      LogMessage("Could not write the trace file " + path, false);
+      return ERR_TRACE_FILE;
+   }
+   return DEVICE_OK;
+}
+
+/**
+ * Trace thread: flushes the trace whenever the I/O thread asks for it,
+ * until the worker is stopped.
+ */
+void AndorAMH::TraceWriter()
+{
+   std::unique_lock<std::mutex> lock(ioLock_);
+   for (;;)
+   {
+      traceCond_.wait(lock, [this] { return traceFlushPending_ || stopIO_; });
+      if (!traceFlushPending_)
+         return;
+      traceFlushPending_ = false;
+      lock.unlock();
+      FlushTrace();
+      lock.lock();
+   }
+}
+
+int AndorAMH::OnDose(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      AccrueDoseLocked(std::chrono::steady_clock::now());
+      pProp->Set(dose_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnOnTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      AccrueDoseLocked(std::chrono::steady_clock::now());
+      pProp->Set(onTime_);
+   }
+
+   return DEVICE_OK;
+}
+
+/**
+ * The dose from now on goes to this tag as well, typically the label of
+ * the stage position about to be imaged, set by the acquisition script.
+ */
+int AndorAMH::OnDoseTag(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   std::lock_guard<std::mutex> guard(ioLock_);
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(doseTag_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      AccrueDoseLocked(std::chrono::steady_clock::now());
+      pProp->Get(doseTag_);
+      tagDose_ = &doseByTag_[doseTag_];
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnTagDose(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      AccrueDoseLocked(std::chrono::steady_clock::now());
+      pProp->Set(*tagDose_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnDosePerTag(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      AccrueDoseLocked(std::chrono::steady_clock::now());
+      std::ostringstream os;
+      for (std::map<std::string, double>::const_iterator it = doseByTag_.begin(); it != doseByTag_.end(); ++it)
+      {
+         if (it->first.empty())
+            continue;
+         if (os.tellp() > 0)
+            os << ";";
+         os << it->first << "=" << it->second;
+      }
+      pProp->Set(os.str().c_str());
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnResetDose(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string val;
+      pProp->Get(val);
+      pProp->Set(g_No);
+      if (val == g_Yes)
+      {
+         std::lock_guard<std::mutex> guard(ioLock_);
+         dose_ = 0.0;
+         onTime_ = 0.0;
+         doseByTag_.clear();
+         tagDose_ = &doseByTag_[doseTag_];
+         doseSince_ = std::chrono::steady_clock::now();
+      }
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnTrace(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(trace_.IsEnabled() ? g_Yes : g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string val;
+      pProp->Get(val);
+      trace_.SetEnabled(val == g_Yes);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnTraceFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   std::lock_guard<std::mutex> guard(ioLock_);
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(traceFile_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(traceFile_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnFlushTrace(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string val;
+      pProp->Get(val);
+      pProp->Set(g_No);
+      if (val == g_Yes)
+         return FlushTrace();
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnFlushTraceOnError(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(flushTraceOnError_ ? g_Yes : g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string val;
+      pProp->Get(val);
+      flushTraceOnError_ = (val == g_Yes);
+   }
+
+   return DEVICE_OK;
+}
+
+/**
+ * Measures the send-to-stable-light time with the calibration sensor over
+ * Calibration Cycles open/close cycles and replaces the settle statistics.
+ * Runs on the caller's thread; the commands still go through the I/O thread.
+ */
+int AndorAMH::CalibrateSettle()
+{
+   MM::Device* device = GetCoreCallback()->GetDevice(this, calibrationSensor_.c_str());
+   MM::SignalIO* sensor = dynamic_cast<MM::SignalIO*>(device);
+   if (sensor == 0)
+      return ERR_NO_CALIBRATION_SENSOR;
+
+   typedef std::chrono::steady_clock clock;
+   std::vector<std::pair<clock::time_point, double> > samples;
+   samples.reserve(100000);
+
+   // start from a settled closed state; acks stop feeding the statistics
+   settleCalibrated_ = true;
+   settleHist_.Reset();
+   int ret = MeasureSettle(sensor, false, samples);
+   for (long cycle = 0; cycle < calibrationCycles_ && ret == DEVICE_OK; cycle++)
+   {
+      for (int i = 0; i < 2 && ret == DEVICE_OK; i++)
+      {
+         bool state = (i == 0);
+         ret = MeasureSettle(sensor, state, samples);
+         if (ret != DEVICE_OK)
+            break;
+
+         // baseline before the switch, final level from the last quarter
+         // of the window, stable once within 5% of the step for good
+         double baseline = samples.front().second;
+         double plateau = 0.0;
+         size_t tail = samples.size() - samples.size() / 4;
+         for (size_t j = tail; j < samples.size(); j++)
+            plateau += samples[j].second;
+         plateau /= (double) (samples.size() - tail);
+         double band = 0.05 * fabs(plateau - baseline);
+         if (band <= 0.0)
+            ret = ERR_CALIBRATION_NO_SIGNAL;
+
+         size_t stable = 0;
+         for (size_t j = 0; j < samples.size(); j++)
+         {
+            if (fabs(samples[j].second - plateau) > band)
+               stable = j + 1;
+         }
+         if (stable >= tail)
+            ret = ERR_CALIBRATION_NO_SIGNAL;
+         if (ret != DEVICE_OK)
+            break;
+
+         clock::time_point sent;
+         {
+            std::lock_guard<std::mutex> guard(ioLock_);
+            sent = settleFrom_;
+         }
+         long long us = std::chrono::duration_cast<std::chrono::microseconds>(samples[stable].first - sent).count();
+         settleHist_.Record(us > 0 ? (uint32_t) us : 0);
+      }
+   }
+
+   // an incomplete calibration is dropped, the acks take over again
+   if (ret != DEVICE_OK)
+   {
+      settleHist_.Reset();
+      settleCalibrated_ = false;
+   }
+
+   // leave the light as the user had it
+   int restore = SetShutterPosition(curState_, true);
+   return ret != DEVICE_OK ? ret : restore;
+}
+
+/**
+ * Switches the light and samples the sensor for AMH_CALIBRATION_WINDOW_MS
+ * while the command goes out.  The first sample is taken before the switch.
+ */
+int AndorAMH::MeasureSettle(MM::SignalIO* sensor, bool state, std::vector<std::pair<std::chrono::steady_clock::time_point, double> >& samples)
+{
+   typedef std::chrono::steady_clock clock;
+   samples.clear();
+   double volts;
+   int ret = sensor->GetSignal(volts);
+   if (ret != DEVICE_OK)
+      return ret;
+   samples.push_back(std::make_pair(clock::now(), volts));
+
+   int result = DEVICE_OK;
+   bool done = false;
+   IOCommand cmd;
+   cmd.level = state ? intensity_ : 0;
+   cmd.result = &result;
+   cmd.done = &done;
+   {
+      std::unique_lock<std::mutex> lock(ioLock_);
+      ret = EnqueueLocked(lock, cmd);
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+
+   clock::time_point end = clock::now() + std::chrono::milliseconds(AMH_CALIBRATION_WINDOW_MS);
+   while (clock::now() < end)
+   {
+      ret = sensor->GetSignal(volts);
+      if (ret != DEVICE_OK)
+         break;
+      samples.push_back(std::make_pair(clock::now(), volts));
+   }
+
+   std::unique_lock<std::mutex> lock(ioLock_);
+   ioDoneCond_.wait(lock, [&done] { return done; });
+   return ret != DEVICE_OK ? ret : result;
+}
+
+int AndorAMH::OnSettleMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(autoSettle_ ? g_Auto : g_Manual);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      autoSettle_ = (mode == g_Auto);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnSettlePercentile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(settlePercentile_.load());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double percentile;
+      pProp->Get(percentile);
+      settlePercentile_ = percentile;
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnSettleTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      pProp->Set(settleHist_.Count() > 0 ? SettleMs() : 0.0);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnCalibrationSensor(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(calibrationSensor_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(calibrationSensor_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnCalibrationCycles(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(calibrationCycles_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(calibrationCycles_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnCalibrateSettle(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string val;
+      pProp->Get(val);
+      pProp->Set(g_No);
+      if (val == g_Yes)
+         return CalibrateSettle();
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnTransport(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(transportName_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      if (initialized_)
+      {
+         // revert
+         pProp->Set(transportName_.c_str());
+         return ERR_PORT_CHANGE_FORBIDDEN;
+      }
+
+      pProp->Get(transportName_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnDirectBaudRate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(baudRate_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      if (initialized_)
+      {
+         // revert
+         pProp->Set(baudRate_);
+         return ERR_PORT_CHANGE_FORBIDDEN;
+      }
+
+      pProp->Get(baudRate_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnMockLatency(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(mock_->GetLatencyUs());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long us;
+      pProp->Get(us);
+      mock_->SetLatencyUs(us);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnMockJitter(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(mock_->GetJitterUs());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long us;
+      pProp->Get(us);
+      mock_->SetJitterUs(us);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnMockErrorRate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(mock_->GetErrorRate());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double rate;
+      pProp->Get(rate);
+      mock_->SetErrorRate(rate);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnMockDropRate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(mock_->GetDropRate());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double rate;
+      pProp->Get(rate);
+      mock_->SetDropRate(rate);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnMockErrorCode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(mock_->GetErrorCode());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      long code;
+      pProp->Get(code);
+      mock_->SetErrorCode(code);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnMockSettle(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(mock_->GetSettleUs() / 1000.0);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double ms;
+      pProp->Get(ms);
+      mock_->SetSettleUs((long) (ms * 1000.0));
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnMockOutput(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(mock_->GetOutput());
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnBurstWidth(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(burstWidthMs_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(burstWidthMs_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnBurstPeriod(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(burstPeriodMs_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(burstPeriodMs_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnBurstCount(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(burstCount_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(burstCount_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnBurstIntensity(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(burstIntensity_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(burstIntensity_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnStartBurst(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string start;
+      pProp->Get(start);
+      pProp->Set(g_No);
+      if (start == g_Yes)
+         return StartBurst();
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnStopBurst(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string stop;
+      pProp->Get(stop);
+      pProp->Set(g_No);
+      if (stop == g_Yes)
+         burstStops_++;
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnRampStart(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(rampStart_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(rampStart_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnRampEnd(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(rampEnd_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(rampEnd_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnRampDuration(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(rampMs_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(rampMs_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnRampShape(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(rampExponential_ ? g_Exponential : g_Linear);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string shape;
+      pProp->Get(shape);
+      rampExponential_ = (shape == g_Exponential);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnStartRamp(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string start;
+      pProp->Get(start);
+      pProp->Set(g_No);
+      if (start == g_Yes)
+         return StartRamp();
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnStopRamp(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string stop;
+      pProp->Get(stop);
+      pProp->Set(g_No);
+      if (stop == g_Yes)
+         rampStops_++;
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnRampResult(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      pProp->Set(rampResult_.c_str());
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMH::OnBurstResult(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      std::lock_guard<std::mutex> guard(ioLock_);
+      pProp->Set(burstResult_.c_str());
+   }
+
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AndorAMHHub
+// ~~~~~~~~~~~
+
+AndorAMHHub::AndorAMHHub() :
+   initialized_(false), units_(2), transportName_(g_SerialTransport), baudRate_(AMH_DIRECT_BAUD),
+   batch_(false)
+{
+   InitializeDefaultErrorMessages();
+
+   // create pre-initialization properties
+   // ------------------------------------
+
+   // Name
+   CreateProperty(MM::g_Keyword_Name, g_AndorAMHHub, MM::String, true);
+
+   // Description
+   CreateProperty(MM::g_Keyword_Description, "Andor AMH200-FOS hub for several units", MM::String, true);
+
+   // Units
+   CPropertyAction* pAct = new CPropertyAction (this, &AndorAMHHub::OnUnits);
+   CreateProperty(g_Units, "2", MM::Integer, false, pAct, true);
+   SetPropertyLimits(g_Units, 1, AMH_MAX_UNITS);
+
+   // Port of every unit; those beyond Units are ignored
+   for (long unit = 1; unit <= AMH_MAX_UNITS; unit++)
+   {
+      ports_[unit - 1] = "Undefined";
+      std::string name = std::string(MM::g_Keyword_Port) + " " + CDeviceUtils::ConvertToString(unit);
+      CPropertyActionEx* pActEx = new CPropertyActionEx (this, &AndorAMHHub::OnUnitPort, unit);
+      CreateProperty(name.c_str(), "Undefined", MM::String, false, pActEx, true);
+   }
+
+   // Transport of all units
+   pAct = new CPropertyAction (this, &AndorAMHHub::OnTransport);
+   CreateProperty(g_Transport, g_SerialTransport, MM::String, false, pAct, true);
+   AddAllowedValue(g_Transport, g_SerialTransport);
+   AddAllowedValue(g_Transport, g_DirectTransport);
+   AddAllowedValue(g_Transport, g_MockTransport);
+
+   pAct = new CPropertyAction (this, &AndorAMHHub::OnDirectBaudRate);
+   CreateProperty(g_DirectBaudRate, CDeviceUtils::ConvertToString(baudRate_), MM::Integer, false, pAct, true);
+   for (int i = 0; i < 5; i++)
+      AddAllowedValue(g_DirectBaudRate, CDeviceUtils::ConvertToString(g_DirectBaudRates[i]));
+}
+
+AndorAMHHub::~AndorAMHHub()
+{
+   Shutdown();
+}
+
+void AndorAMHHub::GetName(char* name) const
+{
+   CDeviceUtils::CopyLimitedString(name, g_AndorAMHHub);
+}
+
+int AndorAMHHub::Initialize()
+{
+   // Batch Commands
+   // --------------
+   CPropertyAction* pAct = new CPropertyAction (this, &AndorAMHHub::OnBatch);
+   int ret = CreateProperty(g_BatchCommands, g_No, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_BatchCommands, g_No);
+   AddAllowedValue(g_BatchCommands, g_Yes);
+
+   initialized_ = true;
+   return DEVICE_OK;
+}
+
+int AndorAMHHub::Shutdown()
+{
+   initialized_ = false;
+   return DEVICE_OK;
+}
+
+/**
+ * One AndorAMH-Unit<n> per configured unit.
+ */
+int AndorAMHHub::DetectInstalledDevices()
+{
+   ClearInstalledDevices();
+   for (long unit = 1; unit <= units_; unit++)
+   {
+      MM::Device* pDev = ::CreateDevice(UnitName(unit).c_str());
+      if (pDev)
+         AddInstalledDevice(pDev);
+   }
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+int AndorAMHHub::OnUnits(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(units_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(units_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMHHub::OnUnitPort(MM::PropertyBase* pProp, MM::ActionType eAct, long unit)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(ports_[unit - 1].c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      if (initialized_)
+      {
+         // revert
+         pProp->Set(ports_[unit - 1].c_str());
+         return ERR_PORT_CHANGE_FORBIDDEN;
+      }
+
+      pProp->Get(ports_[unit - 1]);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMHHub::OnTransport(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(transportName_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(transportName_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMHHub::OnDirectBaudRate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(baudRate_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(baudRate_);
+   }
+
+   return DEVICE_OK;
+}
+
+int AndorAMHHub::OnBatch(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(batch_ ? g_Yes : g_No);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string batch;
+      pProp->Get(batch);
+      batch_ = (batch == g_Yes);
+   }
+
+   return DEVICE_OK;
+}
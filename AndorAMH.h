@@ -25,8 +25,18 @@
 
 #include "../../MMDevice/MMDevice.h"
 #include "../../MMDevice/DeviceBase.h"
+#include "LatencyHistogram.h"
+#include "AMHTransport.h"
+#include "CommandTrace.h"
+#include "AMHTimer.h"
+#include "AMHProtocol.h"
 #include <string>
 #include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 //////////////////////////////////////////////////////////////////////////////
 // Error codes
@@ -34,13 +44,62 @@
 #define ERR_PORT_CHANGE_FORBIDDEN    10004
 #define ERR_UNRECOGNIZED_ANSWER      10009
 #define ERR_UNSPECIFIED_ERROR        10010
+#define ERR_GATED_SEQUENCE           10011
+#define ERR_NO_CALIBRATION_SENSOR    10012
+#define ERR_CALIBRATION_NO_SIGNAL    10013
+#define ERR_NO_HUB                   10014
+#define ERR_UNIT_NOT_ON_HUB          10015
+#define ERR_TRACE_FILE               10016
+#define ERR_DIRECT_OPEN              10017
+#define ERR_PORT_IN_USE              10018
+#define ERR_PRESET_FILE              10019
 
 #define ERR_OFFSET 10100
 
+#define AMH_MAX_LEVEL    100        // LIGHT,0 .. LIGHT,100
+#define AMH_ANSWER_SIZE  32
+#define AMH_QUEUE_DEPTH  64
+#define AMH_MAX_PIPELINE 8          // LIGHT commands in flight at once
+#define AMH_RX_SIZE      256        // receive buffer for framing replies
+#define AMH_ANSWER_TIMEOUT_MS 500   // default of Answer Timeout (ms)
+#define AMH_POLL_US      100        // port polling interval while waiting for a reply
+#define AMH_CALIBRATION_WINDOW_MS 300   // sensor sampling time per transition
+#define AMH_MAX_UNITS    4          // AMH200 units on one AndorAMHHub
+#define AMH_DIRECT_BAUD  9600       // default of Direct Baud Rate
+#define AMH_HEALTH_QUIET 4          // idle Health Check Intervals before the first check
+
+static_assert(AMH_MAX_LEVEL == AMHProtocol::Light::MaxArg, "AMH_MAX_LEVEL is the range of LIGHT");
+
+/**
+ * Fixed-capacity FIFO, so that queueing a command never allocates.
+ */
+template <class T, size_t N>
+class BoundedQueue
+{
+public:
+   BoundedQueue() : head_(0), size_(0) {}
+   bool empty() const { return size_ == 0; }
+   bool full() const { return size_ == N; }
+   size_t size() const { return size_; }
+   T& front() { return items_[head_]; }
+   T& back() { return items_[(head_ + size_ - 1) % N]; }
+   T& operator[](size_t i) { return items_[(head_ + i) % N]; }
+   void push_back(const T& item) { items_[(head_ + size_) % N] = item; size_++; }
+   void pop_front() { head_ = (head_ + 1) % N; size_--; }
+
+private:
+   T items_[N];
+   size_t head_;
+   size_t size_;
+};
+
+class AndorAMHHub;
+
 class AndorAMH : public CShutterBase<AndorAMH>
 {
 public:
-   AndorAMH();
+   // unit > 0 makes this unit of an AndorAMHHub, named after the unit
+   AndorAMH(bool simulated = false, long unit = 0);
    ~AndorAMH();
 
    bool Busy();
@@ -53,20 +112,343 @@ public:
    int GetOpen(bool& open);
    int Fire(double deltaT);
 
+   // intensity for the next opening, for acquisition engines and scripts
+   int ArmIntensity(long level);
+
    // action interface
    // ----------------
    int OnState(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnPort(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnDelay(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnIntensity(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnArmedIntensity(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnPresets(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnPresetFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnPreset(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAsync(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnForceResend(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnFireOnTime(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnHoldOpen(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnHealthInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnLinkState(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnLinkLatency(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTriggerMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnPipelineDepth(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnLatencyStat(MM::PropertyBase* pProp, MM::ActionType eAct, long data);
+   int OnResetStats(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAnswerTimeout(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRetry(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAnswerStat(MM::PropertyBase* pProp, MM::ActionType eAct, long data);
+   int OnDose(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnOnTime(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnDoseTag(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTagDose(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnDosePerTag(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnResetDose(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTrace(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTraceFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnFlushTrace(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnFlushTraceOnError(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSettleMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSettlePercentile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSettleTime(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCalibrationSensor(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCalibrationCycles(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCalibrateSettle(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTransport(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnDirectBaudRate(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMockLatency(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMockJitter(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMockErrorRate(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMockDropRate(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMockErrorCode(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMockSettle(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMockOutput(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnBurstWidth(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnBurstPeriod(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnBurstCount(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnBurstIntensity(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnStartBurst(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnStopBurst(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnBurstResult(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRampStart(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRampEnd(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRampDuration(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRampShape(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnStartRamp(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnStopRamp(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRampResult(MM::PropertyBase* pProp, MM::ActionType eAct);
 
 private:
-   int SetShutterPosition(bool state);
+   // a LIGHT command waiting on the I/O queue; synchronous callers keep
+   // result/done on their stack and wait for the worker to fill them in.
+   // Intensity updates are coalesced: a newer one replaces an unsent one.
+   // A non-zero pulseMs turns the command into an open/close pulse (Fire).
+   // The time points are filled in as the command passes through the queue
+   // and the I/O thread
+   struct IOCommand
+   {
+      IOCommand() : level(0), result(0), done(0), coalesce(false), pulseMs(0.0),
+         burstCount(0), burstPeriodMs(0.0), stops(0), rampTo(0), rampMs(0.0), rampExponential(false),
+         solo(false) {}
+
+      // pulses, trains and ramps need the link to themselves
+      bool Exclusive() const { return pulseMs > 0.0 || rampMs > 0.0; }
+
+      long level;
+      int* result;
+      bool* done;
+      bool coalesce;
+      double pulseMs;
+      long burstCount;              // > 0: a train of pulseMs pulses
+      double burstPeriodMs;
+      unsigned stops;               // stop count the train or ramp was queued under
+      long rampTo;                  // ramp from level to rampTo over rampMs > 0
+      double rampMs;
+      bool rampExponential;
+      std::chrono::steady_clock::time_point queued;
+      std::chrono::steady_clock::time_point sent;
+      std::chrono::steady_clock::time_point written;
+      bool solo;                    // nothing else was in flight
+   };
+
+   // latency histograms, recorded by the I/O thread for acknowledged commands
+   enum LatencyStage { SendStage, AckWaitStage, TotalStage, NumStages };
+   LatencyHistogram latency_[NumStages];
+   void RecordLatency(const IOCommand& cmd);
+
+   // Auto settle mode: Busy() stays true until the calibrated percentile of
+   // the send-to-stable-light time has passed since the last command was
+   // sent.  Timing from the send rather than the ack keeps the return path
+   // jitter out of it.  Until a sensor calibration has run, settleHist_ is
+   // fed the send-to-ack time of every acknowledged command instead, which
+   // counts from the ack with Delay as the floor
+   std::atomic<bool> autoSettle_;   // read by Busy() without a lock
+   std::atomic<double> settlePercentile_;
+   std::atomic<bool> settleCalibrated_;    // settleHist_ holds sensor data
+   LatencyHistogram settleHist_;
+   std::chrono::steady_clock::time_point settleFrom_;  // sent time of the last acked command
+   std::string calibrationSensor_;
+   long calibrationCycles_;
+   double SettleMs() const;
+   int CalibrateSettle();
+   int MeasureSettle(MM::SignalIO* sensor, bool state, std::vector<std::pair<std::chrono::steady_clock::time_point, double> >& samples);
+
+   int SetShutterPosition(bool state, bool force = false);
+   int HoldOpen();
+   int UpdateIntensity();
+   bool IsRedundant(long level) const;
+   int EnqueueLocked(std::unique_lock<std::mutex>& lock, const IOCommand& cmd);
+   int EnqueueAndReport(const IOCommand& cmd, int& earlier);
+   int TakeAsyncErrorLocked();
+   void TakeArmedIntensity();
+   int LoadPresets(const std::string& text, const std::string& file);
+   int ApplyPreset(const std::string& name);
+   int SendLightCommand(long level);
+   int WriteLightCommand(long level);
+   int ReadLightAck(long level, bool publish = true);
+   int ReadReply(char* reply, unsigned size);
+   int ResyncPort();
+   void DropLeftovers();
+   int TimedLightCommand(long level, std::chrono::steady_clock::time_point& sent);
+   int SendPulse(long level, double pulseMs);
+   int SendBurst(const IOCommand& cmd);
+   void WaitUntil(std::chrono::steady_clock::time_point t);
+   bool WaitUnlessStopped(std::chrono::steady_clock::time_point t, const std::atomic<unsigned>& stops, unsigned queuedUnder);
+   int StartBurst();
+   int SendRamp(const IOCommand& cmd);
+   int StartRamp();
+   void IOWorker();
+   int RetryAfterTimeout(IOCommand& cmd, BoundedQueue<IOCommand, AMH_MAX_PIPELINE>& inFlight);
+   void CheckLink(std::unique_lock<std::mutex>& lock);
+   void CompleteCommand(const IOCommand& cmd, int ret);
+   void UpdateRoundTrip(const IOCommand& cmd);
+   void StopIOWorker();
+   bool simulated_;                 // AndorAMH-Sim: always on the mock transport
+   long unit_;                      // 1.. on a hub, else 0
+   AndorAMHHub* hub_;               // set in Initialize() for a hub unit
    bool initialized_;
    std:: string port_;
-   MM::MMTime changedTime_;
    long intensity_;
+   long armedIntensity_;            // 0, or the level the next opening takes
+
+   // named light levels, 0 for off, each sent as light_.Text(level)
+   std::map<std::string, long> presets_;
+   std::string presetText_;
+   std::string presetFile_;
+   std::string preset_;             // last applied, or g_NoPreset
    bool curState_;
+   bool externalTrigger_;           // light gated by the camera's TTL output
+   std::atomic<bool> sequenceRunning_;     // read by the I/O thread
+
+   // all serial traffic runs on ioThread_; clients only touch ioQueue_.
+   // In asynchronous mode callers do not wait for their command, and Busy()
+   // stays true until its acknowledgement has arrived
+   bool async_;
+   std::thread ioThread_;
+   std::mutex ioLock_;              // guards the members below
+   std::condition_variable ioCond_;
+   std::condition_variable ioDoneCond_;
+   BoundedQueue<IOCommand, AMH_QUEUE_DEPTH> ioQueue_;
+   bool ioInFlight_;
+   bool stopIO_;
+   int asyncError_;
+   long pipelineDepth_;
+   long lastLevel_;                 // last acknowledged LIGHT value, -1 if unknown
+   double fireOnTimeMs_;            // achieved on-time of the last Fire pulse
+
+   // Hold Open Below: a close is held back for holdOpenMs_ and dropped if
+   // the light is opened again before then, so auto-shutter frames with
+   // short gaps do not pay for two round trips and a settle per frame.  The
+   // light stays on during the gap; the worker sends the close at holdUntil_
+   double holdOpenMs_;              // 0 closes at once
+   bool holdPending_;
+   std::chrono::steady_clock::time_point holdUntil_;
+
+   // Health check: once the link has been idle for AMH_HEALTH_QUIET times
+   // healthIntervalMs_, and then every healthIntervalMs_, the worker runs
+   // CheckLink(), but not while Busy() or a State sequence runs.  A client
+   // command arriving during a check still waits for its round trip, so
+   // an acquisition with frame gaps that long can meet one; the interval
+   // should be well above the frame period.  The link state follows every
+   // answer or timeout, the latency every answered command
+   enum LinkState { LinkUnknown, LinkUp, LinkLost };
+   long healthIntervalMs_;          // 0 switches the check off
+   long checkLevel_;                // level of the last check, -1 once a command went out
+   std::atomic<int> linkState_;
+   std::atomic<long> linkLatencyUs_;
+
+   // Light dose in percent-seconds, advanced on every ack and when read;
+   // guarded by ioLock_.  doseByTag_ nodes stay put, so tagDose_ is O(1)
+   long doseLevel_;                 // last acknowledged level, kept through errors
+   std::chrono::steady_clock::time_point doseSince_;
+   double dose_;
+   double onTime_;
+   std::string doseTag_;
+   std::map<std::string, double> doseByTag_;
+   double* tagDose_;                // doseByTag_[doseTag_]
+   void AccrueDoseLocked(std::chrono::steady_clock::time_point now);
+
+   // What GetOpen() and Busy() need, packed into one word so the core's
+   // polling loads it without a lock or a string conversion and always sees
+   // a consistent set: the light state, whether commands are queued or in
+   // flight, the intensity, and the time (us since snapshotEpoch_) that the
+   // settle delay runs from.  Every writer changes only its own fields
+   enum
+   {
+      SnapOpen = 1,
+      SnapBusy = 2,
+      SnapIntensityShift = 8,
+      SnapTimeShift = 16
+   };
+   std::atomic<uint64_t> snapshot_;
+   std::chrono::steady_clock::time_point snapshotEpoch_;
+   void Publish(uint64_t mask, uint64_t bits);
+   void PublishSetting();
+   void PublishBusyLocked();
+   void PublishChange(std::chrono::steady_clock::time_point t);
+   void SetSettleFromLocked(std::chrono::steady_clock::time_point sent);
+
+   // I/O thread only
+   double roundTripMs_;             // running average of the LIGHT round trip
+
+   // "LIGHT,n\r" for every level, built once so a toggle does not allocate
+   AMHProtocol::Table<AMHProtocol::Light> light_;
+
+   // byte link used by the I/O thread, created in Initialize()
+   std::string transportName_;
+   long baudRate_;                  // of the Direct transport
+   AMHTransport* transport_;
+   AMHMockTransport* mock_;         // transport_ when it is the mock, else 0
+   AMHTimerService* timer_;         // shared by all devices, held from Initialize()
+   bool portClaimed_;
+
+   // pulse train run by the I/O thread, see SendBurst()
+   double burstWidthMs_;
+   double burstPeriodMs_;
+   long burstCount_;
+   long burstIntensity_;
+   // bumped by Stop Burst and by every client switch of the light; a train
+   // ends once it differs from the count the train was queued under
+   std::atomic<unsigned> burstStops_;
+   std::string burstResult_;        // guarded by ioLock_
+
+   // intensity ramp run by the I/O thread, see SendRamp()
+   long rampStart_;
+   long rampEnd_;
+   double rampMs_;
+   bool rampExponential_;
+   std::atomic<unsigned> rampStops_;        // as burstStops_, for ramps
+   std::string rampResult_;         // guarded by ioLock_
+
+   // persistent receive buffer, split into replies on '\r'.  Replies still
+   // owed to commands that timed out are discarded when they turn up
+   char rxBuf_[AMH_RX_SIZE];
+   unsigned rxLen_;
+   unsigned staleReplies_;
+   std::atomic<long> answerTimeoutMs_;
+   std::atomic<bool> retry_;        // resend a LIGHT command once after a timeout
+   std::atomic<long> timeouts_;     // answer timeouts, shown with the stats
+   std::atomic<long> retries_;
+   bool resynced_;                  // set by ResyncPort, replies in flight are lost
+
+   // every LIGHT write and answer, recorded by the I/O thread, see
+   // CommandTrace.h; written to traceFile_ by Flush Trace and, if
+   // flushTraceOnError_, by traceThread_ when an E,nn answer arrives, so
+   // the file I/O stays off the command path
+   CommandTrace trace_;
+   std::string traceFile_;          // guarded by ioLock_
+   std::atomic<bool> flushTraceOnError_;
+   std::thread traceThread_;
+   std::condition_variable traceCond_;
+   bool traceFlushPending_;         // guarded by ioLock_
+   int FlushTrace();
+   void TraceWriter();
+};
+
+/**
+ * Rig with several AMH200 units.  The hub holds the serial port of every
+ * unit and the transport choice, and detects one AndorAMH-Unit<n> shutter
+ * per unit, each running the unit's link on its own I/O thread.  With
+ * Batch Commands set, unit shutters queue their switches without waiting
+ * for the acks, so a channel switch that touches several units puts all
+ * its LIGHT commands on the wire at once and costs one round trip instead
+ * of one per unit; Busy() of each unit still covers its ack.
+ */
+class AndorAMHHub : public HubBase<AndorAMHHub>
+{
+public:
+   AndorAMHHub();
+   ~AndorAMHHub();
+
+   int Initialize();
+   int Shutdown();
+   void GetName(char* pszName) const;
+   bool Busy() { return false; }
+   int DetectInstalledDevices();
+
+   // for the units
+   long GetUnits() const { return units_; }
+   std::string GetUnitPort(long unit) const { return ports_[unit - 1]; }
+   std::string GetTransportName() const { return transportName_; }
+   long GetBaudRate() const { return baudRate_; }
+   bool Batching() const { return batch_; }
+
+   // action interface
+   // ----------------
+   int OnUnits(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnUnitPort(MM::PropertyBase* pProp, MM::ActionType eAct, long unit);
+   int OnTransport(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnDirectBaudRate(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnBatch(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+private:
+   bool initialized_;
+   long units_;
+   std::string ports_[AMH_MAX_UNITS];
+   std::string transportName_;
+   long baudRate_;
+   std::atomic<bool> batch_;        // read by the unit shutters on every switch
 };
 
 #endif //_ANDORAMH_H_
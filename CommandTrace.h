@@ -0,0 +1,177 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CommandTrace.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   In-memory binary trace of the Andor AMH200 command stream
+// COPYRIGHT:     University of California, San Francisco, 2006
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _COMMANDTRACE_H_
+#define _COMMANDTRACE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+/**
+ * Ring of the last Capacity events on the link, 16 bytes each: the time in
+ * us since the trace was created, the event, the LIGHT level and, for an
+ * E,nn answer, the error number.
+ *
+ * Record() is meant for a single writer, the I/O thread, and is lock-free
+ * and allocation-free.  Write() may run on any thread at the same time; the
+ * records overwritten while it copies are left out of the file.
+ *
+ * File layout, little-endian: the 8 bytes "AMHTRC01", the wall-clock time
+ * of the trace's time origin in us since 1970 (uint64), the number of
+ * records (uint64), then the records as two uint64 words each: the time,
+ * and event | level << 8 | code << 16.  Decode() prints such a file.
+ */
+class CommandTrace
+{
+public:
+   enum Event
+   {
+      Send = 1,         // LIGHT,level written
+      Ack,              // R received for level
+      Error,            // E,code received for level
+      Unrecognised,     // anything else received
+      Timeout,          // no answer for level within the answer timeout
+      Retry,            // level sent again after a timeout
+      Resync            // port purged, answers in flight dropped; no level
+   };
+
+   static const unsigned Capacity = 4096;   // a power of two
+
+   CommandTrace() : head_(0), enabled_(true), epoch_(std::chrono::steady_clock::now())
+   {
+      epochWallUs_ = (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(
+         std::chrono::system_clock::now().time_since_epoch()).count();
+   }
+
+   void SetEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+   bool IsEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+   void Record(Event event, long level, long code = 0)
+   {
+      if (!enabled_.load(std::memory_order_relaxed))
+         return;
+      uint64_t us = (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(
+         std::chrono::steady_clock::now() - epoch_).count();
+      uint64_t head = head_.load(std::memory_order_relaxed);
+      std::atomic<uint64_t>* slot = records_[head & (Capacity - 1)];
+      slot[0].store(us, std::memory_order_relaxed);
+      slot[1].store((uint64_t) event | ((uint64_t) (level & 0xff) << 8) | ((uint64_t) (code & 0xffff) << 16),
+         std::memory_order_relaxed);
+      head_.store(head + 1, std::memory_order_release);
+   }
+
+   /**
+    * Writes the records still in the ring to path, oldest first.
+    */
+   bool Write(const char* path) const
+   {
+      uint64_t before = head_.load(std::memory_order_acquire);
+      std::vector<uint64_t> words(2 * Capacity);
+      for (unsigned i = 0; i < Capacity; i++)
+      {
+         words[2 * i] = records_[i][0].load(std::memory_order_relaxed);
+         words[2 * i + 1] = records_[i][1].load(std::memory_order_relaxed);
+      }
+      uint64_t after = head_.load(std::memory_order_acquire);
+
+      // slots reused while copying, and the one the writer may be filling,
+      // hold newer records than the rest
+      uint64_t first = after >= Capacity ? after - Capacity + 1 : 0;
+      uint64_t count = before > first ? before - first : 0;
+
+      FILE* file = fopen(path, "wb");
+      if (file == 0)
+         return false;
+      bool ok = fwrite("AMHTRC01", 1, 8, file) == 8 && WriteWord(file, epochWallUs_) && WriteWord(file, count);
+      for (uint64_t i = first; i < first + count && ok; i++)
+      {
+         unsigned slot = (unsigned) (i & (Capacity - 1));
+         ok = WriteWord(file, words[2 * slot]) && WriteWord(file, words[2 * slot + 1]);
+      }
+      return fclose(file) == 0 && ok;
+   }
+
+   /**
+    * Prints a trace file as text, one record per line.  Returns false if
+    * in is not a trace file or is truncated.
+    */
+   static bool Decode(FILE* in, FILE* out)
+   {
+      static const char* names[] = { "?", "send", "ack", "error", "unrecognised", "timeout", "retry", "resync" };
+
+      char magic[8];
+      uint64_t epochUs, count;
+      if (fread(magic, 1, 8, in) != 8 || memcmp(magic, "AMHTRC01", 8) != 0 ||
+            !ReadWord(in, epochUs) || !ReadWord(in, count))
+         return false;
+
+      for (uint64_t i = 0; i < count; i++)
+      {
+         uint64_t us, data;
+         if (!ReadWord(in, us) || !ReadWord(in, data))
+            return false;
+         uint64_t wall = epochUs + us;
+         time_t secs = (time_t) (wall / 1000000);
+         char stamp[32];
+         strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", gmtime(&secs));
+         unsigned event = (unsigned) (data & 0xff);
+         fprintf(out, "%s.%06u  %-12s", stamp, (unsigned) (wall % 1000000),
+            names[event < sizeof(names) / sizeof(names[0]) ? event : 0]);
+         if (event != Resync)
+            fprintf(out, " LIGHT,%u", (unsigned) ((data >> 8) & 0xff));
+         if (event == Error)
+            fprintf(out, "  E,%u", (unsigned) ((data >> 16) & 0xffff));
+         fprintf(out, "\n");
+      }
+      return true;
+   }
+
+private:
+   static bool WriteWord(FILE* file, uint64_t word)
+   {
+      unsigned char bytes[8];
+      for (int i = 0; i < 8; i++)
+         bytes[i] = (unsigned char) (word >> (8 * i));
+      return fwrite(bytes, 1, 8, file) == 8;
+   }
+
+   static bool ReadWord(FILE* file, uint64_t& word)
+   {
+      unsigned char bytes[8];
+      if (fread(bytes, 1, 8, file) != 8)
+         return false;
+      word = 0;
+      for (int i = 7; i >= 0; i--)
+         word = (word << 8) | bytes[i];
+      return true;
+   }
+
+   std::atomic<uint64_t> records_[Capacity][2];
+   std::atomic<uint64_t> head_;
+   std::atomic<bool> enabled_;
+   std::chrono::steady_clock::time_point epoch_;
+   uint64_t epochWallUs_;
+};
+
+#endif //_COMMANDTRACE_H_
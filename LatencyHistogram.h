@@ -0,0 +1,131 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          LatencyHistogram.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Fixed-bucket latency histogram for the Andor AMH200 adapter
+// COPYRIGHT:     University of California, San Francisco, 2006
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _LATENCYHISTOGRAM_H_
+#define _LATENCYHISTOGRAM_H_
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Histogram of latencies in microseconds.  Values below 16 us get a bucket
+ * each; above that every power of two is split into four buckets, so the
+ * reported percentiles are within 25% of the true value up to ~70 minutes.
+ *
+ * Record() is lock-free and allocation-free and may run concurrently with
+ * the readers and with Reset(); a reset racing a record may lose that one
+ * sample, which is fine for statistics.
+ */
+class LatencyHistogram
+{
+public:
+   static const unsigned NumBuckets = 128;
+
+   LatencyHistogram() { Reset(); }
+
+   void Record(uint32_t us)
+   {
+      buckets_[BucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+      count_.fetch_add(1, std::memory_order_relaxed);
+
+      uint32_t cur = min_.load(std::memory_order_relaxed);
+      while (us < cur && !min_.compare_exchange_weak(cur, us, std::memory_order_relaxed))
+         ;
+      cur = max_.load(std::memory_order_relaxed);
+      while (us > cur && !max_.compare_exchange_weak(cur, us, std::memory_order_relaxed))
+         ;
+   }
+
+   void Reset()
+   {
+      for (unsigned i = 0; i < NumBuckets; i++)
+         buckets_[i].store(0, std::memory_order_relaxed);
+      count_.store(0, std::memory_order_relaxed);
+      min_.store(UINT32_MAX, std::memory_order_relaxed);
+      max_.store(0, std::memory_order_relaxed);
+   }
+
+   uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+
+   uint32_t Min() const
+   {
+      uint32_t v = min_.load(std::memory_order_relaxed);
+      return v == UINT32_MAX ? 0 : v;
+   }
+
+   uint32_t Max() const { return max_.load(std::memory_order_relaxed); }
+
+   /**
+    * Upper edge of the bucket holding the given fraction (0..1) of the
+    * samples, clamped to the observed min and max.
+    */
+   uint32_t Percentile(double fraction) const
+   {
+      uint64_t total = 0;
+      for (unsigned i = 0; i < NumBuckets; i++)
+         total += buckets_[i].load(std::memory_order_relaxed);
+      if (total == 0)
+         return 0;
+
+      uint64_t rank = (uint64_t) (fraction * (double) total + 0.5);
+      if (rank < 1)
+         rank = 1;
+      uint64_t seen = 0;
+      unsigned i = 0;
+      for (; i < NumBuckets - 1; i++)
+      {
+         seen += buckets_[i].load(std::memory_order_relaxed);
+         if (seen >= rank)
+            break;
+      }
+
+      uint64_t edge = i + 1 < NumBuckets ? (uint64_t) LowerEdge(i + 1) - 1 : UINT32_MAX;
+      if (edge > Max())
+         edge = Max();
+      if (edge < Min())
+         edge = Min();
+      return (uint32_t) edge;
+   }
+
+private:
+   static unsigned BucketOf(uint32_t us)
+   {
+      if (us < 16)
+         return us;
+      unsigned octave = 31;
+      while ((us >> octave) == 0)
+         octave--;
+      return 16 + (octave - 4) * 4 + ((us >> (octave - 2)) & 3);
+   }
+
+   static uint32_t LowerEdge(unsigned bucket)
+   {
+      if (bucket < 16)
+         return bucket;
+      unsigned octave = 4 + (bucket - 16) / 4;
+      return (uint32_t) ((4 + (bucket - 16) % 4) << (octave - 2));
+   }
+
+   std::atomic<uint32_t> buckets_[NumBuckets];
+   std::atomic<uint64_t> count_;
+   std::atomic<uint32_t> min_;
+   std::atomic<uint32_t> max_;
+};
+
+#endif //_LATENCYHISTOGRAM_H_
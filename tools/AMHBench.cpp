@@ -0,0 +1,289 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AMHBench.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Benchmark and soak test of the Andor AMH200 adapter's
+//                client calls, run against an AndorAMH-Sim device on the
+//                mock transport with no core attached.  Not part of the
+//                adapter build:
+//                  c++ -std=c++11 -pthread -o AMHBench AMHBench.cpp
+//                     ../AndorAMH.cpp ../AMHTransport.cpp ../AMHTimer.cpp
+//                     ../../../MMDevice/*.cpp
+// COPYRIGHT:     University of California, San Francisco, 2006
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "../AndorAMH.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <atomic>
+
+typedef std::chrono::steady_clock clock_type;
+
+static uint32_t ElapsedUs(clock_type::time_point since)
+{
+   return (uint32_t) std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - since).count();
+}
+
+static long GetLong(AndorAMH& amh, const char* name)
+{
+   char value[MM::MaxStrLength];
+   if (amh.GetProperty(name, value) != DEVICE_OK)
+      return -1;
+   return atol(value);
+}
+
+static void WaitIdle(AndorAMH& amh)
+{
+   while (amh.Busy())
+      std::this_thread::sleep_for(std::chrono::microseconds(AMH_POLL_US));
+}
+
+/**
+ * Runs one workload through the public client calls and prints throughput
+ * (until the device is idle again), per-call latency, and the number and
+ * rate of plain LIGHT commands acknowledged (Fire pulses are not counted).
+ */
+static int RunBenchmark(AndorAMH& amh, const std::string& workload, long iterations)
+{
+   bool async = (workload == "async" || workload == "pipelined");
+   bool intensity = (workload == "intensity");
+   bool fire = (workload == "fire");
+   if (!async && !intensity && !fire && workload != "setopen")
+   {
+      fprintf(stderr, "unknown workload %s\n", workload.c_str());
+      return 2;
+   }
+
+   amh.SetProperty("Asynchronous", async ? "Yes" : "No");
+   if (workload == "pipelined")
+      amh.SetProperty("Pipeline Depth", CDeviceUtils::ConvertToString(AMH_MAX_PIPELINE));
+   if (intensity)
+      amh.SetOpen(true);
+
+   LatencyHistogram perCall;
+   long sentBefore = GetLong(amh, "Latency Total Count");
+   long errors = 0;
+   clock_type::time_point start = clock_type::now();
+   for (long i = 0; i < iterations; i++)
+   {
+      // a full queue would make an asynchronous call wait for the link;
+      // drain it every half queue so the per-call time is the caller's alone
+      if (async && i > 0 && i % (AMH_QUEUE_DEPTH / 2) == 0)
+         WaitIdle(amh);
+      clock_type::time_point callStart = clock_type::now();
+      int ret;
+      if (intensity)
+         ret = amh.SetProperty("Intensity", CDeviceUtils::ConvertToString(1 + i % 100));
+      else if (fire)
+         ret = amh.Fire(1.0);
+      else
+         ret = amh.SetOpen(i % 2 == 0);
+      perCall.Record(ElapsedUs(callStart));
+      if (ret != DEVICE_OK)
+         errors++;
+   }
+   WaitIdle(amh);
+   double elapsedMs = std::chrono::duration<double, std::milli>(clock_type::now() - start).count();
+   long sent = GetLong(amh, "Latency Total Count") - sentBefore;
+
+   // a close also reports an error an asynchronous command left behind
+   if (amh.SetOpen(false) != DEVICE_OK)
+      errors++;
+   WaitIdle(amh);
+
+   printf("%s: %ld calls in %.1f ms, %.0f calls/s; per call p50 %.3f ms, p99 %.3f ms, max %.3f ms; "
+      "%ld LIGHT commands acknowledged, %.0f/s, %ld errors\n",
+      workload.c_str(), iterations, elapsedMs, iterations * 1000.0 / elapsedMs,
+      perCall.Percentile(0.50) / 1000.0, perCall.Percentile(0.99) / 1000.0, perCall.Max() / 1000.0,
+      sent, sent * 1000.0 / elapsedMs, errors);
+   return errors == 0 ? 0 : 1;
+}
+
+/**
+ * Runs three client threads against the device for the given time and
+ * prints a summary.  An acquisition thread toggles SetOpen every half frame
+ * interval and waits for Busy() to clear, a GUI thread sets Intensity as
+ * fast as it can, and a script thread polls Busy() and GetOpen().  The
+ * first two are serialised on one lock, as the core does for calls that
+ * change a device; the poller takes no lock.
+ *
+ * Ordering violations counted: GetOpen() not returning the state just set;
+ * the mock not at 0 once a close is done, i.e. an intensity update
+ * overtook it (not checked while Hold Open Below is on); the mock at 0
+ * once an open is done; and at the end the mock or the Intensity property
+ * not matching the last state and intensity set.  The open and close
+ * checks only run when Busy() clears before the next toggle, the others
+ * are reported as still busy.
+ */
+static int RunSoak(AndorAMH& amh, long seconds, double frameMs, bool async)
+{
+   amh.SetProperty("Asynchronous", async ? "Yes" : "No");
+   char value[MM::MaxStrLength];
+   amh.GetProperty("Hold Open Below (ms)", value);
+   double holdOpenMs = atof(value);
+
+   std::mutex clientLock;
+   std::atomic<bool> stop(false);
+   std::atomic<long> violations(0);
+   std::atomic<long> errors(0);
+   long overruns = 0;                 // toggles still busy at the next one
+   LatencyHistogram toggleLatency, intensityLatency, pollLatency;
+   long lastIntensity = GetLong(amh, "Intensity");   // last values set, under clientLock
+   bool lastState = false;
+   amh.GetOpen(lastState);
+
+   auto count = [&](int ret) { if (ret != DEVICE_OK) errors++; };
+
+   clock_type::time_point start = clock_type::now();
+   clock_type::time_point end = start + std::chrono::seconds(seconds);
+   clock_type::duration halfFrame = std::chrono::duration_cast<clock_type::duration>(
+      std::chrono::duration<double, std::milli>(frameMs / 2.0));
+
+   std::thread acquisition([&]() {
+      clock_type::time_point next = clock_type::now();
+      for (long i = 0; !stop; i++)
+      {
+         bool open = i % 2 == 0;
+         int ret;
+         {
+            std::lock_guard<std::mutex> guard(clientLock);
+            clock_type::time_point callStart = clock_type::now();
+            ret = amh.SetOpen(open);
+            toggleLatency.Record(ElapsedUs(callStart));
+            lastState = open;
+            bool reported;
+            amh.GetOpen(reported);
+            if (reported != open)
+               violations++;
+         }
+         count(ret);
+         next += halfFrame;
+         while (amh.Busy() && clock_type::now() < next && !stop)
+            std::this_thread::sleep_for(std::chrono::microseconds(AMH_POLL_US));
+         if (amh.Busy())
+            overruns++;
+         else if (ret == DEVICE_OK)
+         {
+            long level;
+            {
+               std::lock_guard<std::mutex> guard(clientLock);
+               level = GetLong(amh, "Mock Light Output");
+            }
+            if (open ? level == 0 : (level != 0 && holdOpenMs <= 0.0))
+               violations++;
+         }
+         std::this_thread::sleep_until(next);
+      }
+   });
+
+   std::thread gui([&]() {
+      for (long i = 0; !stop; i++)
+      {
+         long level = 1 + i % 100;
+         int ret;
+         {
+            std::lock_guard<std::mutex> guard(clientLock);
+            clock_type::time_point callStart = clock_type::now();
+            ret = amh.SetProperty("Intensity", CDeviceUtils::ConvertToString(level));
+            intensityLatency.Record(ElapsedUs(callStart));
+            lastIntensity = level;
+         }
+         count(ret);
+         std::this_thread::yield();
+      }
+   });
+
+   std::thread script([&]() {
+      while (!stop)
+      {
+         clock_type::time_point callStart = clock_type::now();
+         bool open;
+         amh.Busy();
+         amh.GetOpen(open);
+         pollLatency.Record(ElapsedUs(callStart));
+         std::this_thread::yield();
+      }
+   });
+
+   std::this_thread::sleep_until(end);
+   stop = true;
+   acquisition.join();
+   gui.join();
+   script.join();
+   double elapsedS = std::chrono::duration<double>(clock_type::now() - start).count();
+
+   WaitIdle(amh);
+   if (holdOpenMs > 0.0)
+   {
+      // a held close is sent once the hold has run out
+      std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(holdOpenMs));
+      WaitIdle(amh);
+   }
+   bool state;
+   amh.GetOpen(state);
+   if (GetLong(amh, "Intensity") != lastIntensity || state != lastState)
+      violations++;
+   if (GetLong(amh, "Mock Light Output") != (lastState ? lastIntensity : 0))
+      violations++;
+
+   // re-sending the last state also reports an error an asynchronous
+   // command left behind
+   if (amh.SetOpen(lastState) != DEVICE_OK)
+      errors++;
+   WaitIdle(amh);
+
+   printf("%.0f s: SetOpen %.0f/s p99 %.3f ms max %.3f ms; Intensity %.0f/s p99 %.3f ms max %.3f ms; "
+      "Busy+GetOpen %.0f/s p99 %.3f ms max %.3f ms; %ld ordering violations, %ld errors, %ld toggles still busy at the next\n",
+      elapsedS,
+      toggleLatency.Count() / elapsedS, toggleLatency.Percentile(0.99) / 1000.0, toggleLatency.Max() / 1000.0,
+      intensityLatency.Count() / elapsedS, intensityLatency.Percentile(0.99) / 1000.0, intensityLatency.Max() / 1000.0,
+      pollLatency.Count() / elapsedS, pollLatency.Percentile(0.99) / 1000.0, pollLatency.Max() / 1000.0,
+      violations.load(), errors.load(), overruns);
+   return violations == 0 && errors == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+   if (argc < 2)
+   {
+      fprintf(stderr,
+         "usage: %s setopen|intensity|fire|async|pipelined [iterations [latency-us]]\n"
+         "       %s soak|async-soak [seconds [frame-ms [latency-us]]]\n", argv[0], argv[0]);
+      return 2;
+   }
+   std::string workload = argv[1];
+   bool soak = (workload == "soak" || workload == "async-soak");
+   long iterations = argc > 2 ? atol(argv[2]) : (soak ? 60 : 1000);
+   double frameMs = soak && argc > 3 ? atof(argv[3]) : 10.0;
+   const char* latency = argc > (soak ? 4 : 3) ? argv[soak ? 4 : 3] : "1000";
+
+   AndorAMH amh(true);
+   int ret = amh.Initialize();
+   if (ret != DEVICE_OK)
+   {
+      fprintf(stderr, "Initialize failed: %d\n", ret);
+      return 1;
+   }
+   amh.SetProperty("Mock Latency (us)", latency);
+
+   int result;
+   if (soak)
+      result = RunSoak(amh, iterations, frameMs, workload == "async-soak");
+   else
+      result = RunBenchmark(amh, workload, iterations);
+   amh.Shutdown();
+   return result;
+}
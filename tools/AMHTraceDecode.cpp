@@ -0,0 +1,47 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AMHTraceDecode.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Prints a trace file written by the Andor AMH200 adapter's
+//                Flush Trace as text.  Not part of the adapter build:
+//                  c++ -std=c++11 -o AMHTraceDecode AMHTraceDecode.cpp
+// COPYRIGHT:     University of California, San Francisco, 2006
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "../CommandTrace.h"
+#include <cstdio>
+
+int main(int argc, char* argv[])
+{
+   if (argc != 2)
+   {
+      fprintf(stderr, "usage: %s tracefile\n", argv[0]);
+      return 2;
+   }
+
+   FILE* in = fopen(argv[1], "rb");
+   if (in == 0)
+   {
+      perror(argv[1]);
+      return 1;
+   }
+   bool ok = CommandTrace::Decode(in, stdout);
+   fclose(in);
+   if (!ok)
+   {
+      fprintf(stderr, "%s: not a trace file, or truncated\n", argv[1]);
+      return 1;
+   }
+   return 0;
+}